@@ -0,0 +1,434 @@
+/**
+ * bench.c
+ * -------
+ * Micro-benchmarks for the thread_107 primitives themselves. Each benchmark
+ * runs at 1, 2, 4, ... up to N threads (N defaults to the number of online
+ * cores, at least 2), times batches of operations and prints one CSV row per
+ * run so results can be diffed or plotted from run to run:
+ *
+ *     benchmark,threads,ops,ops_per_sec,median_ns,p99_ns
+ *
+ * median_ns and p99_ns are per-operation latencies, taken over batches of
+ * BATCH operations so the clock does not dominate what is measured.
+ *
+ *     gcc -O2 -Wall bench.c thread_107.c -o bench -lpthread
+ *     ./bench [maxThreads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include "thread_107.h"
+
+#define BATCH 64 // operations timed together
+#define SAMPLES 2000 // timed batches per thread
+#define SPAWN_SAMPLES 50 // timed batches for the (much slower) spawn benchmark
+
+/* One benchmark: body runs SAMPLES batches of BATCH operations on thread
+ * `self` of `nThreads`, storing one per-operation latency per batch. */
+typedef struct Benchmark {
+    const char *name;
+    bool pairs; // threads work in pairs (ping-pong), so only even counts run
+    void (*setup)(int nThreads);
+    void (*body)(int self, int nThreads, uint64_t *samples);
+    void (*teardown)(int nThreads);
+} Benchmark;
+
+static atomic_int go; // released once every thread of a run is ready
+static _Atomic uint64_t sink; // bodies add their results here so none is optimized away
+static WaitGroup ready;
+static uint64_t *allSamples; // SAMPLES per thread
+
+static uint64_t NowNanos(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+/* ---- semaphores ---- */
+static Semaphore *semaphores;
+static Semaphore sharedSemaphore;
+
+static void SetupOwnSemaphores(int nThreads)
+{
+    semaphores = malloc(sizeof(Semaphore) * nThreads);
+    for (int i = 0; i < nThreads; i++)
+        semaphores[i] = SemaphoreNew("bench own", 0);
+}
+
+static void TeardownOwnSemaphores(int nThreads)
+{
+    for (int i = 0; i < nThreads; i++)
+        SemaphoreFree(semaphores[i]);
+    free(semaphores);
+}
+
+static void UncontendedBody(int self, int nThreads, uint64_t *samples)
+{
+    Semaphore s = semaphores[self];
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++) {
+            SemaphoreSignal(s);
+            SemaphoreWait(s);
+        }
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+}
+
+static void SetupSharedSemaphore(int nThreads)
+{
+    sharedSemaphore = SemaphoreNew("bench shared", 1);
+}
+
+static void SetupPrioritizedSemaphore(int nThreads)
+{
+    sharedSemaphore = SemaphoreNewPrioritized("bench prioritized", 1);
+}
+
+static void TeardownSharedSemaphore(int nThreads)
+{
+    SemaphoreFree(sharedSemaphore);
+}
+
+static void ContendedBody(int self, int nThreads, uint64_t *samples)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++) {
+            SemaphoreWait(sharedSemaphore);
+            SemaphoreSignal(sharedSemaphore);
+        }
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+}
+
+/* Thread 2k pings thread 2k+1 through semaphores[2k] and waits for the pong
+ * on semaphores[2k+1]; a sample is one full round trip. */
+static void PingPongBody(int self, int nThreads, uint64_t *samples)
+{
+    Semaphore ping = semaphores[self & ~1];
+    Semaphore pong = semaphores[self | 1];
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++) {
+            if (self % 2 == 0) {
+                SemaphoreSignal(ping);
+                SemaphoreWait(pong);
+            } else {
+                SemaphoreWait(ping);
+                SemaphoreSignal(pong);
+            }
+        }
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+}
+
+/* ---- critical sections ---- */
+static long counter;
+static Lock counterLock;
+
+static void ProtectBody(int self, int nThreads, uint64_t *samples)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++)
+            PROTECT(counter++);
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+}
+
+static void SetupLock(int nThreads)
+{
+    counterLock = LockNew("bench counter");
+}
+
+static void TeardownLock(int nThreads)
+{
+    LockFree(counterLock);
+}
+
+static void ProtectWithBody(int self, int nThreads, uint64_t *samples)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++)
+            PROTECT_WITH(counterLock, counter++);
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+}
+
+static QueueLock counterQueueLock;
+
+static void SetupQueueLock(int nThreads)
+{
+    counterQueueLock = QueueLockNew("bench queue lock");
+}
+
+static void TeardownQueueLock(int nThreads)
+{
+    QueueLockFree(counterQueueLock);
+}
+
+static void QueueLockBody(int self, int nThreads, uint64_t *samples)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++) {
+            QueueLockAcquire(counterQueueLock);
+            counter++;
+            QueueLockRelease(counterQueueLock);
+        }
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+}
+
+/* ---- reader-writer lock ---- */
+static RWLock counterRWLock;
+
+static void SetupRWLock(int nThreads)
+{
+    counterRWLock = RWLockNew("bench rwlock", true);
+}
+
+static void TeardownRWLock(int nThreads)
+{
+    RWLockFree(counterRWLock);
+}
+
+static void RWLockReadBody(int self, int nThreads, uint64_t *samples)
+{
+    uint64_t seen = 0;
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++)
+            PROTECT_READ(counterRWLock, seen += counter);
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+    atomic_fetch_add_explicit(&sink, seen, memory_order_relaxed);
+}
+
+// thread 0 writes once per batch, the rest only read.
+static void RWLockMostlyReadBody(int self, int nThreads, uint64_t *samples)
+{
+    uint64_t seen = 0;
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++) {
+            if (self == 0 && j == 0) {
+                PROTECT_WRITE(counterRWLock, counter++);
+            } else {
+                PROTECT_READ(counterRWLock, seen += counter);
+            }
+        }
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+    atomic_fetch_add_explicit(&sink, seen, memory_order_relaxed);
+}
+
+/* ---- barrier ---- */
+static Barrier phaseBarrier;
+
+static void SetupBarrier(int nThreads)
+{
+    phaseBarrier = BarrierNew("bench barrier", nThreads);
+}
+
+static void TeardownBarrier(int nThreads)
+{
+    BarrierFree(phaseBarrier);
+}
+
+// one operation is one phase that all nThreads threads go through together.
+static void BarrierBody(int self, int nThreads, uint64_t *samples)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++)
+            BarrierWait(phaseBarrier);
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+}
+
+/* ---- token pool ---- */
+static TokenPool tokenPool;
+
+static void SetupTokenPool(int nThreads)
+{
+    tokenPool = TokenPoolNew("bench tokens", (long)nThreads * SAMPLES * BATCH);
+}
+
+static void TeardownTokenPool(int nThreads)
+{
+    TokenPoolFree(tokenPool);
+}
+
+static void TokenPoolBody(int self, int nThreads, uint64_t *samples)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++)
+            TokenPoolTake(tokenPool);
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+}
+
+/* ---- random numbers ---- */
+static void ThreadRandomBody(int self, int nThreads, uint64_t *samples)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++)
+            value += ThreadRandomBelow(1000);
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+    atomic_fetch_add_explicit(&sink, value, memory_order_relaxed);
+}
+
+/* ---- async log ---- */
+static void ThreadLogBody(int self, int nThreads, uint64_t *samples)
+{
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++)
+            ThreadLog("thread %d of %d, batch %d op %d\n", self, nThreads, i, j);
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+}
+
+/* ---- threads ---- */
+static void ThreadNameBody(int self, int nThreads, uint64_t *samples)
+{
+    uint64_t names = 0;
+    for (int i = 0; i < SAMPLES; i++) {
+        uint64_t start = NowNanos();
+        for (int j = 0; j < BATCH; j++)
+            names += (uintptr_t)ThreadName();
+        samples[i] = (NowNanos() - start) / BATCH;
+    }
+    atomic_fetch_add_explicit(&sink, names, memory_order_relaxed);
+}
+
+static void *Noop(void *args)
+{
+    return NULL;
+}
+
+static const Benchmark benchmarks[] = {
+    { "semaphore_uncontended", false, SetupOwnSemaphores, UncontendedBody, TeardownOwnSemaphores },
+    { "semaphore_contended", false, SetupSharedSemaphore, ContendedBody, TeardownSharedSemaphore },
+    { "semaphore_prioritized", false, SetupPrioritizedSemaphore, ContendedBody, TeardownSharedSemaphore },
+    { "semaphore_ping_pong", true, SetupOwnSemaphores, PingPongBody, TeardownOwnSemaphores },
+    { "protect", false, NULL, ProtectBody, NULL },
+    { "protect_with", false, SetupLock, ProtectWithBody, TeardownLock },
+    { "queue_lock", false, SetupQueueLock, QueueLockBody, TeardownQueueLock },
+    { "rwlock_read", false, SetupRWLock, RWLockReadBody, TeardownRWLock },
+    { "rwlock_mostly_read", false, SetupRWLock, RWLockMostlyReadBody, TeardownRWLock },
+    { "barrier", false, SetupBarrier, BarrierBody, TeardownBarrier },
+    { "token_pool", false, SetupTokenPool, TokenPoolBody, TeardownTokenPool },
+    { "thread_random", false, NULL, ThreadRandomBody, NULL },
+    { "thread_log", false, NULL, ThreadLogBody, NULL },
+    { "thread_name", false, NULL, ThreadNameBody, NULL },
+};
+
+/* ---- harness ---- */
+static void *BenchThread(void *args)
+{
+    const Benchmark *bench = ((const Benchmark **)args)[1];
+    int self = (int)(intptr_t)((void **)args)[2];
+    int nThreads = (int)(intptr_t)((void **)args)[3];
+
+    WaitGroupDone(ready);
+    while (!atomic_load(&go)) sched_yield();
+    bench->body(self, nThreads, allSamples + (size_t)self * SAMPLES);
+    return NULL;
+}
+
+static int CompareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void Report(const char *name, int nThreads, uint64_t *samples, int count, uint64_t ops, uint64_t elapsedNs)
+{
+    qsort(samples, count, sizeof(uint64_t), CompareSamples);
+    printf("%s,%d,%llu,%.0f,%llu,%llu\n", name, nThreads, (unsigned long long)ops,
+           ops * 1e9 / (elapsedNs ? elapsedNs : 1),
+           (unsigned long long)samples[count / 2],
+           (unsigned long long)samples[(int)(count * 0.99)]);
+    fflush(stdout);
+}
+
+static void RunBenchmark(const Benchmark *bench, int nThreads)
+{
+    if (bench->setup != NULL) bench->setup(nThreads);
+    atomic_store(&go, 0);
+    ready = WaitGroupNew(nThreads);
+
+    for (int i = 0; i < nThreads; i++)
+        ThreadNew(bench->name, BenchThread, 3, bench, (void *)(intptr_t)i, (void *)(intptr_t)nThreads);
+    WaitGroupWait(ready);
+
+    uint64_t start = NowNanos();
+    atomic_store(&go, 1);
+    JoinAllThreads();
+    uint64_t elapsed = NowNanos() - start;
+
+    // for ping-pong only the pinging half of the threads counts round trips.
+    int step = bench->pairs ? 2 : 1;
+    int count = 0;
+    for (int i = 0; i < nThreads; i += step)
+        for (int j = 0; j < SAMPLES; j++)
+            allSamples[count++] = allSamples[(size_t)i * SAMPLES + j];
+    Report(bench->name, nThreads, allSamples, count, (uint64_t)count * BATCH, elapsed);
+
+    WaitGroupFree(ready);
+    if (bench->teardown != NULL) bench->teardown(nThreads);
+}
+
+/* ThreadNew + launch + join cost, measured from the main thread. */
+static void RunSpawnBenchmark(void)
+{
+    uint64_t samples[SPAWN_SAMPLES];
+    uint64_t start = NowNanos();
+    for (int i = 0; i < SPAWN_SAMPLES; i++) {
+        uint64_t batchStart = NowNanos();
+        for (int j = 0; j < BATCH; j++)
+            ThreadNew("bench spawn", Noop, 0);
+        JoinAllThreads();
+        samples[i] = (NowNanos() - batchStart) / BATCH;
+    }
+    Report("thread_spawn", 1, samples, SPAWN_SAMPLES, (uint64_t)SPAWN_SAMPLES * BATCH, NowNanos() - start);
+}
+
+int main(int argc, char **argv)
+{
+    int maxThreads = argc == 2 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxThreads < 2) maxThreads = 2;
+
+    InitThreadPackage(false);
+    UseAsyncLog("/dev/null", LOG_BLOCK); // thread_log measures the logging threads, not the disk
+    RunAllThreads(); // from here on ThreadNew starts threads immediately
+    allSamples = malloc(sizeof(uint64_t) * SAMPLES * maxThreads);
+
+    printf("benchmark,threads,ops,ops_per_sec,median_ns,p99_ns\n");
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        const Benchmark *bench = &benchmarks[b];
+        for (int n = bench->pairs ? 2 : 1; ; n *= 2) {
+            if (n > maxThreads) n = maxThreads;
+            if (!bench->pairs || n % 2 == 0) RunBenchmark(bench, n);
+            if (n == maxThreads) break;
+        }
+    }
+    RunSpawnBenchmark();
+
+    free(allSamples);
+    FreeThreadPackage();
+    return EXIT_SUCCESS;
+}
@@ -8,28 +8,35 @@
  */
 #include "thread_107.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include<string.h>
 
-#define NUM_DINERS 5
+#define NUM_DINERS 5 // unless given on the command line
 #define EAT_TIMES 3
 /* Macros to conveniently refer to forks to left and right of each person */
 #define LEFT(philNum) (philNum)
-#define RIGHT(philNum) (((philNum)+1) % NUM_DINERS)
+#define RIGHT(philNum) (((philNum)+1) % numDiners)
+
+static int numDiners = NUM_DINERS;
+static Barrier course; // everybody finishes a course before the next is served
 /*
  * Our main is creates a semaphore for every fork in an unlocked state
- * (one philosopher can immediately acquire each fork) and sets up the
- * numEating semaphore to only allow N-1 philosophers to try and grab
- * their forks. Each philosopher runs its own thread. They should
- * finish after getting their fill of spaghetti. By running with the
- 15
- * -v flag, it will include the trace output from the thread library.
+ * (one philosopher can immediately acquire each fork). There is no global
+ * throttle: each philosopher picks up both forks at once with
+ * SemaphoreWaitAll, so only neighbours ever wait for each other and the
+ * table seats thousands (./dinning 5000) as easily as five. Each
+ * philosopher runs its own thread. The meal is served in EAT_TIMES
+ * courses, and the course barrier holds everybody who has eaten until the
+ * whole table has, so the same threads go on to the next course without
+ * being re-created. They should finish after getting their fill of
+ * spaghetti. By running with the -v flag, it will include the trace output
+ * from the thread library.
  */
 
 
 static void* Philosopher(void* args);
 static void Think(void);
-static void Eat(Semaphore numEating, Semaphore leftFork, Semaphore rightFork);
-Semaphore finish;
+static void Eat(Semaphore forks[2]);
 
 
 
@@ -37,38 +44,36 @@ void main(int argc, char **argv)
 {
     int i;
     char name[32];
-    bool verbose = (argc == 2 && (strcmp(argv[1], "-v") == 0));
+    bool verbose = false;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) verbose = true;
+        else numDiners = atoi(argv[i]);
+    }
+    if (numDiners < 2) numDiners = NUM_DINERS;
     InitThreadPackage(verbose);
+    UseAsyncLog(NULL, LOG_BLOCK); // philosophers log without taking stdout's lock
     
-    Semaphore fork[NUM_DINERS]; // semaphore to control access per fork
-    Semaphore numEating; // to restrict contention for forks
-    finish = SemaphoreNew("finish", 0);
+    Semaphore *fork = malloc(sizeof(Semaphore) * numDiners); // semaphore to control access per fork
+    course = BarrierNew("Course", numDiners);
     
-    for (i = 0; i < NUM_DINERS; i++) { // Create all fork semaphores
+    for (i = 0; i < numDiners; i++) { // Create all fork semaphores
         sprintf(name, "Fork %d", i);
         fork[i] = SemaphoreNew(name, 1); // all forks start available
     }
-    numEating = SemaphoreNew("Num Eating", NUM_DINERS - 1);
-    for (i = 0; i < NUM_DINERS; i++) { // Create all philosopher threads
+    for (i = 0; i < numDiners; i++) { // Create all philosopher threads
         sprintf(name, "Philosopher %d", i);
-        int index = i;
-        ThreadNew(name, Philosopher, 3, &numEating, &fork, index);
+        ThreadNew(name, Philosopher, 2, fork, (void *)(intptr_t)i);
     }
     RunAllThreads();
-    
-    // This is required since we are not using office thread_107.h
-    // This thread_107.h is provided by github public code
-    for(int i=0; i< NUM_DINERS; i++)
-    {
-        SemaphoreWait(finish);
-    }
-    
+    JoinAllThreads();
+    LogFlush();
     
     printf("All done!\n");
-    SemaphoreFree(finish);
-    SemaphoreFree(numEating);
-    for (i = 0; i < NUM_DINERS; i++)
+    for (i = 0; i < numDiners; i++)
         SemaphoreFree(fork[i]);
+    free(fork);
+    BarrierFree(course);
+    FreeThreadPackage(); // also writes the trace when run with -v
 }
 /**
  * Philosopher
@@ -79,42 +84,34 @@ void main(int argc, char **argv)
 static void* Philosopher(void* args)
 {
     
-    Semaphore numEating = *((Semaphore **) args)[1];
-    Semaphore* fork = ((Semaphore **) args)[2];
-    int index = ((int **) args)[3];
+    Semaphore* fork = ((Semaphore **) args)[1];
+    int index = (int)(intptr_t)((void **) args)[2];
     
-    Semaphore leftFork = fork[LEFT(index)];
-    Semaphore rightFork = fork[RIGHT(index)];
+    Semaphore forks[2] = { fork[LEFT(index)], fork[RIGHT(index)] };
     
     for (int i = 0; i < EAT_TIMES; i++) {
         Think();
-        Eat(numEating, leftFork, rightFork);
+        Eat(forks);
+        if (BarrierWait(course)) // the last one to finish reports the course
+            ThreadLog("Course %d done!\n", i + 1);
     }
-    
-    SemaphoreSignal(finish);
+    return NULL;
 }
 static void Think(void)
 {
-    printf("%s thinking!\n", ThreadName());
+    ThreadLog("%s thinking!\n", ThreadName());
     //RandomDelay(10000,50000); // "think" for random time
 }
 /**
- * We first wait on the availability of an opportunity to eat, and
- * only then do we attempt to grab our left & right forks and chow
- * some spaghetti. Notice that we let go of the locks in the reverse
- * order that we acquire them, so that we don't signal another
- * philosopher to eat until after we have put down both our forks.
+ * We take both forks in one SemaphoreWaitAll: it never holds one fork while
+ * blocked on the other, so the table cannot deadlock, and a philosopher
+ * only ever waits for a neighbour who is actually eating.
  */
-static void Eat(Semaphore numEating, Semaphore leftFork, Semaphore rightFork)
+static void Eat(Semaphore forks[2])
 {
-    SemaphoreWait(numEating); // wait until can try to get forks
-    SemaphoreWait(leftFork); // get left
-    SemaphoreWait(rightFork); // get right
-    
+    SemaphoreWaitAll(forks, 2); // get left and right
     
-    printf("%s eating!\n", ThreadName());
+    ThreadLog("%s eating!\n", ThreadName());
     //RandomDelay(10000,50000); // "eat" for random time
-    SemaphoreSignal(leftFork); // let go
-    SemaphoreSignal(rightFork);
-    SemaphoreSignal(numEating);
+    SemaphoreSignalAll(forks, 2); // let go
 }
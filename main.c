@@ -7,30 +7,27 @@ void *test_func(void *args)
 {
 
     char *debugName = *(char **)args;
-    printf("Thread: %s is start running\n", debugName);
+    ThreadLog("Thread: %s is start running\n", debugName);
 
-    Semaphore *done = ((Semaphore **)args)[1];
-    Semaphore *canIGiveYouSomeMoney = ((Semaphore **)args)[2];
-    int *total_money = ((int **)args)[3];
+    Lock moneyLock = ((Lock *)args)[1];
+    int *total_money = ((int **)args)[2];
 
-    PROTECT(
+    PROTECT_WITH(moneyLock,
         *total_money += 1;
-        printf("Thread: %s, total_money is: %d now.\n", debugName, *total_money);
+        ThreadLog("Thread: %s, total_money is: %d now.\n", debugName, *total_money);
     )
 
-    SemaphoreSignal(*done);
-
     return NULL;
 }
 
 int main(int argc, char **argv)
 {
     InitThreadPackage(false);
+    UseAsyncLog(NULL, LOG_BLOCK); // tasks log without taking stdout's lock
 
     int no = 50; // the num of threads.
 
-    Semaphore done = SemaphoreNew("done", 0);
-    Semaphore canIGiveYouSomeMoney = SemaphoreNew("canIGiveYouSomeMoney", 1);
+    Lock moneyLock = LockNew("moneyLock"); // only guards total_money
 
     int totoal_money = 0;
 
@@ -39,15 +36,12 @@ int main(int argc, char **argv)
         // itos
         char str[12];
         sprintf(str, "test_%d", i);
-        ThreadNew(str, test_func, 3, &done, &canIGiveYouSomeMoney, &totoal_money);
+        ThreadNew(str, test_func, 2, moneyLock, &totoal_money);
     }
 
     RunAllThreads();
-
-    for (int i = 0; i < no; i++)
-    {
-        SemaphoreWait(done);
-    }
+    JoinAllThreads();
+    LogFlush();
 
     printf("All tasks finished, total money is: %d\n", totoal_money);
 
@@ -60,6 +54,7 @@ int main(int argc, char **argv)
     ListAllSemaphores();
     ListAllThreads();
     
+    LockFree(moneyLock);
     FreeThreadPackage();
     printf("all done \n");
     return EXIT_SUCCESS;
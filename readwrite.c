@@ -1,16 +1,17 @@
 /**
  * readWrite.c
  * --------------
- * The canonical consumer-producer example. This version has just one reader * and just one writer (although it could be generalized to multiple readers/ * writers) communicating information through a shared buffer. There are two * generalized semaphores used, one to track the num of empty buffers, another * to track full buffers. Each is used to count, as well as control access.
+ * The canonical consumer-producer example. Several writers and several
+ * readers communicate through one shared bounded buffer, a Channel from
+ * thread_107. The channel does the counting of empty and full slots that
+ * two generalized semaphores used to do, and each slot is handed to exactly
+ * one reader, so writers never overwrite each other's data.
  */
 #include "thread_107.h"
 #include <stdio.h>
 #define NUM_TOTAL_BUFFERS 5
 #define DATA_LENGTH 20
 
-Semaphore finish;
-
-
 /**
  * ProcessData
  * -----------
@@ -42,56 +43,42 @@ static char PrepareData(int i)
 /**
  * Writer
  * ------
- * This is the routine forked by the Writer thread. It will loop until * all data is written. It prepares the data to be written, then waits * for an empty buffer to be available to write the data to, after which * it signals that a full buffer is ready.
+ * This is the routine forked by the Writer thread. It will loop until * all data is written. It prepares the data to be written, then sends it, * which waits for an empty buffer only when the channel is full.
  */
 static void* Writer(void* args)
 {
-    int i, writePt = 0;
+    int i;
     char data;
     
     
-    Semaphore emptyBuffers = *((Semaphore **)args)[1];
-    Semaphore fullBuffers = *((Semaphore **)args)[2];
-    char *buffers = ((char **) args)[3];
+    Channel buffers = ((Channel *)args)[1];
     
     for (i = 0; i < DATA_LENGTH; i++) {
         data = PrepareData(i);
-        SemaphoreWait(emptyBuffers);
-        *(buffers + writePt) = data;
-        printf("%s: buffer[%d] = %c\n", ThreadName(), writePt, data); writePt = (writePt + 1) % NUM_TOTAL_BUFFERS;
-        SemaphoreSignal(fullBuffers);
+        ChannelSend(buffers, &data); // wait for an empty buffer & fill it
+        ThreadLog("%s: sent %c\n", ThreadName(), data);
     }
-    
-    SemaphoreSignal(finish);
 }
 
 // announce full buffer ready
 /**
  * Reader
  * ------
- * This is the routine forked by the Reader thread. It will loop until * all data is read. It waits until a full buffer is available and the * reads from it, signals that now an empty buffer is ready, and then * goes off and processes the data.
+ * This is the routine forked by the Reader thread. It will loop until * all data is read. It waits until a full buffer is available and takes * its value, which frees the buffer for a writer, and then goes off and * processes the data.
  */
 static void *Reader(void* args)
 {
-    int i, readPt = 0;
+    int i;
     char data;
     
     
-    Semaphore emptyBuffers = *((Semaphore **)args)[1];
-    Semaphore fullBuffers = *((Semaphore **)args)[2];
-    char *buffers  = ((char **) args)[3];
+    Channel buffers = ((Channel *)args)[1];
     
     for (i = 0; i < DATA_LENGTH; i++) {
-        SemaphoreWait(fullBuffers); // wait til something to read
-        data = *(buffers + readPt); // pull value out of buffer
-        printf("\t\t%s: buffer[%d] = %c\n", ThreadName(), readPt, data);
-        readPt = (readPt + 1) % NUM_TOTAL_BUFFERS;
-        SemaphoreSignal(emptyBuffers); // announce empty buffer
+        ChannelReceive(buffers, &data); // wait til something to read
+        ThreadLog("\t\t%s: received %c\n", ThreadName(), data);
         //ProcessData(data); // now go off & process data
     }
-    
-    SemaphoreSignal(finish);
-    
 }
 // go off & get data ready
 // now wait til an empty buffer avail
@@ -99,9 +86,8 @@ static void *Reader(void* args)
 
 
 /**
- * Initially, all buffers are empty, so our empty buffer semaphore starts
- * with a count equal to the total number of buffers, while our full buffer * semaphore begins at zero. We create two threads: one to read and one
- * to write, and then start them off running. They will finish after all
+ * Initially, all buffers of the channel are empty. We create three writer
+ * and three reader threads, and then start them off running. They will finish after all
  * data has been written & read. By running with the -v flag, it will include * the trace output from the thread library.
  */
 
@@ -109,43 +95,36 @@ static void *Reader(void* args)
 void main(int argc, char **argv)
 {
     bool verbose = (argc == 2 && (strcmp(argv[1], "-v") == 0));
-    Semaphore emptyBuffers, fullBuffers; // semaphores used as counters
-    char *buffers = malloc( NUM_TOTAL_BUFFERS * sizeof(char)); // the shared buffer
     InitThreadPackage(verbose);
+    UseAsyncLog(NULL, LOG_BLOCK); // writers and readers log without taking stdout's lock
     
     
-    finish = SemaphoreNew("finish", 0);
-    emptyBuffers = SemaphoreNew("Empty Buffers", NUM_TOTAL_BUFFERS);
-    fullBuffers = SemaphoreNew("Full Buffers", 0);
-    
+    Channel buffers = ChannelNew("Buffers", sizeof(char), NUM_TOTAL_BUFFERS); // the shared buffer
     
-    ListAllSemaphores();
     
+    ThreadId writers[3];
     for(int i=0; i<3; i++){
         char str[12];
         sprintf(str,"Writer %d", i);
-        ThreadNew(str, Writer, 3, &emptyBuffers, &fullBuffers, &buffers);
+        writers[i] = ThreadNew(str, Writer, 1, buffers);
     }
     
     
+    // each Reader shares a cache with a Writer, so the buffer lines stay close.
     for(int i=0; i<3; i++){
         char str[12];
         sprintf(str,"Reader %d", i);
-        ThreadNew(str, Reader, 3, &emptyBuffers, &fullBuffers, &buffers);
+        ThreadPlaceNear(ThreadNew(str, Reader, 1, buffers), writers[i]);
     }
     
     
     
     
     RunAllThreads();
-    // This is required since thread_107.h is not a offical library
-    for(int i=0; i< 6; i++){
-        SemaphoreWait(finish);
-    }
+    JoinAllThreads();
     
-    SemaphoreFree(emptyBuffers);
-    SemaphoreFree(fullBuffers);
-    SemaphoreFree(finish);
+    ChannelFree(buffers);
+    FreeThreadPackage(); // also writes the trace when run with -v
     printf("All done!\n");
     
 }
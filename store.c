@@ -13,10 +13,21 @@
  * the clerks who need the manager to approve their work, the cashier
  * who tries to the customer in an orderly line, and so on that require
  * use of semaphores to coordinate the activities.
+ *
+ * Every step takes a random while. By default the store runs on a simulated
+ * clock, so hours of store time pass in milliseconds and every run takes the
+ * same course; -r runs it in real time instead.
+ *
+ *     ./store [-v] [-r] [numCustomers [numManagers]]
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "thread_107.h"
-#define NUM_CUSTOMERS 10
+#define NUM_CUSTOMERS 10 // default, the first number on the command line overrides it
+#define NUM_MANAGERS 1 // default, the second number on the command line overrides it
+#define STACK_SIZE (32 * 1024) // per green thread, plenty for these functions and printf
 #define SECOND 1000000
 static void Cashier(void);
 static void Clerk(void* args);
@@ -29,7 +40,6 @@ static void MakeCone(void);
 static bool InspectCone(void);
 static void Checkout(int linePosition);
 static void Browse(void);
-Semaphore FinishedThread;
 /* We have many variables accessed by multiple threads in this program and
  * so we have chosen to make them global. In order to keep things tidy, we
  * arrange the globals into coherent structures so that it is easy to
@@ -38,89 +48,112 @@ Semaphore FinishedThread;
  * their use and grouping.
  */
 struct inspection { // struct of globals for Clerk->Manager rendezvous
-    Semaphore available; // lock used to serialize access to the one Manager
-    Semaphore requested; // signaled by clerk when cone is ready to inspect
-    Semaphore finished; // signaled by manager after cone has been inspected
-    bool passed; // status of the last inspection
+    Mailbox requests; // clerks call with a cone, a manager replies with the verdict
+    atomic_int numPerfect; // perfect cones so far, over all managers
+    int totalNeeded; // perfect cones the customers want in all
 } inspection;
 struct line { // struct of globals for Customer->Cashier line
-    Semaphore lock; // lock used to serialize access to counter
-    int nextPlaceInLine; // counter
-    Semaphore customers[NUM_CUSTOMERS]; // rendezvous for customer by position
+    QueueLock order; // held by the customer at the register, granted in arrival order
     Semaphore customerReady;// signaled by customer when ready to check out
+    Semaphore checkedOut; // signaled by cashier when the customer at the register is through
 } line;
+static int numCustomers = NUM_CUSTOMERS;
+static int numManagers = NUM_MANAGERS;
 
 /*
  * The main just sets up all the semaphores and creates all the starting
  * threads. We have one thread per customer, each that is set to buy a
  * random number of cones. We keep track of the total cones needed so
- * we can pass that information to the manager.
+ * we can pass that information to the manager. The threads are green
+ * threads with small stacks, so the store holds 100000 customers
+ * (./store 100000) and their clerks as easily as ten.
  */
 int main(int argc, char **argv)
 {
-    int i, numCones = 4, totalCones = 0;
-    bool verbose = (argc == 2 && (strcmp(argv[1], "-v") == 0));
+    int i, numCones = 4, totalCones = 0, numbers = 0;
+    bool verbose = false, realTime = false;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-v") == 0) verbose = true;
+        else if (strcmp(argv[i], "-r") == 0) realTime = true;
+        else if (numbers++ == 0) numCustomers = atoi(argv[i]);
+        else numManagers = atoi(argv[i]);
+    }
+    if (numCustomers < 1) numCustomers = NUM_CUSTOMERS;
+    if (numManagers < 1) numManagers = NUM_MANAGERS;
     InitThreadPackage(verbose);
+    if (realTime) UseGreenThreads(0, STACK_SIZE); // one worker per core
+    else {
+        UseGreenThreads(1, STACK_SIZE); // one worker keeps the simulation reproducible
+        UseVirtualTime();
+    }
+    UseAsyncLog(NULL, LOG_BLOCK); // tasks log without taking stdout's lock
     
     SetupSemaphores();
-    FinishedThread = SemaphoreNew("Finished", 0);
     
-    for (i = 0; i < NUM_CUSTOMERS; i++) {
+    for (i = 0; i < numCustomers; i++) {
         char name[32];
         sprintf(name, "Customer %d", i);
         ThreadNew(name, Customer, 1, &numCones);
         totalCones += numCones;
     }
     
-    ThreadNew("Cashier", Cashier, 0);
-    ThreadNew("Manager", Manager, 1, &totalCones);
-    RunAllThreads();
-    
+    inspection.totalNeeded = totalCones;
     
-    // This is required from the unoffical thread_107.c
-    for(int i=0; i< NUM_CUSTOMERS; i++){
-        SemaphoreWait(FinishedThread);
+    // the cashier and the managers serve everybody else, so when they wake
+    // up they run ahead of the crowd of customers and clerks.
+    ThreadNewPrioritized("Cashier", THREAD_PRIORITY_MAX, Cashier, 0);
+    for (i = 0; i < numManagers; i++) {
+        char name[32];
+        sprintf(name, "Manager %d", i);
+        ThreadNewPrioritized(name, THREAD_PRIORITY_MAX, Manager, 0);
     }
+    uint64_t start = ThreadNowNanos();
+    RunAllThreads();
+    JoinAllThreads(); // customers, clerks, the cashier and the managers
+    LogFlush();
     
-    
-    printf("All done!\n");
+    printf("All done! The store was open for %.1f %s seconds.\n",
+           (ThreadNowNanos() - start) / 1e9, realTime ? "real" : "simulated");
     FreeSemaphores();
-    SemaphoreFree(FinishedThread);
+    FreeThreadPackage(); // also writes the trace when run with -v
     return 0;
 }
 /**
- * The manager has a pretty easy job. He just waits around until a clerk
- * has made an ice cream cone and wants the manager to check it over. The
- * manager efficiently waits for the signal from the clerk and then once
- * awakened, inspects the cone and determines its status, writing to a
- * global variable, and then signals back to the clerk that he has passed
- * judgment. Note that variables like numPerfect and numInspections can and
- * should be local to the Manager since no other thread needs access to them.
+ * The managers have a pretty easy job. Each just waits around until a clerk
+ * has made an ice cream cone and wants a manager to check it over. The
+ * mailbox hands every request to exactly one manager, oldest first, so
+ * several managers can inspect at once. The manager inspects the cone and
+ * replies with its verdict, which wakes just the clerk who asked. The
+ * manager who approves the last cone anybody needs closes the mailbox,
+ * which sends the others home. Note that variables like numPerfect and
+ * numInspections can and should be local to the Manager since no other
+ * thread needs access to them.
  */
 static void Manager(void* args)
 {
-    int totalNeeded = *((Semaphore**) args)[1];
     int numPerfect = 0, numInspections = 0;
-    while (numPerfect < totalNeeded) {
-        SemaphoreWait(inspection.requested);
-        inspection.passed = InspectCone(); // safe since clerk acquired lock
+    MailboxEnvelope request;
+    while ((request = MailboxReceive(inspection.requests, NULL)) != NULL) {
+        bool passed = InspectCone();
         numInspections++;
-        if (inspection.passed)
+        if (passed) {
             numPerfect++;
-        SemaphoreSignal(inspection.finished);
+            if (atomic_fetch_add(&inspection.numPerfect, 1) + 1 == inspection.totalNeeded)
+                MailboxClose(inspection.requests); // every cone is done
+        }
+        MailboxReply(request, (void *)(intptr_t)passed);
     }
-    printf("Inspection success rate %d%%\n", (100*numPerfect)/numInspections);
+    if (numInspections > 0)
+        ThreadLog("%s inspection success rate %d%%\n", ThreadName(), (100*numPerfect)/numInspections);
 }
 
 /*
  * A Clerk thread is dispatched by the customer for each cone they want.
- * The clerk makes the cone and then has to have the manager inspect it.
- * If it doesn't pass, they have to make another. To check with the manager,
- * the clerk has to acquire the exclusive rights to confer with the manager,
- * then signal to wake up the manager, and then wait until they have passed
- * judgment (by writing to a global). We need to be sure that we don't
- * release the inspection lock until we have read the status and are
- * totally done with our inspection. Once we have a perfect ice cream,
+ * The clerk makes the cone and then has to have a manager inspect it.
+ * If it doesn't pass, they have to make another. To check with a manager,
+ * the clerk calls the inspection mailbox, which queues the request and
+ * blocks until a manager replies to this very request, so no lock and no
+ * shared status variable are needed. Once we have a perfect ice cream,
  * we signal back to the originating customer by means of the rendezvous
  * semaphore passed as a parameter to this thread.
  */
@@ -132,11 +165,9 @@ static void Clerk(void* args)
     bool passed = false;
     while (!passed) {
         MakeCone();
-        SemaphoreWait(inspection.available);
-        SemaphoreSignal(inspection.requested);
-        SemaphoreWait(inspection.finished);
-        passed = inspection.passed;
-        SemaphoreSignal(inspection.available);
+        void *verdict;
+        if (!MailboxCall(inspection.requests, NULL, &verdict)) break; // closed, no manager left
+        passed = verdict != NULL;
     }
     
     SemaphoreSignal(done);
@@ -149,16 +180,16 @@ static void Clerk(void* args)
  * that semaphore to "count" the number of clerks who have finished.
  * In the second loop, we wait once for each clerk, which allows
  * us to efficiently block until all clerks check back in.
- * Then we get in line for the cashier by "taking the next number"
- * that is available and signaling our presence to the cashier.
- * When they call our number (signal the semaphore at our place
- * in line), we're done.
+ * Then we get in line for the cashier: the line is a queue lock, so
+ * we get to the register only after everybody who lined up before us.
+ * There we signal our presence to the cashier, and once we are checked
+ * out we leave the register to the next in line and we're done.
  */
 static void Customer(void* args)
 {
     
     int numConesWanted = *((Semaphore **) args)[1];
-    int i, myPlace;
+    int i;
     Semaphore clerksDone = SemaphoreNew("Count of clerks done", 0);
     
     for (i = 0; i < numConesWanted; i++)
@@ -171,31 +202,28 @@ static void Customer(void* args)
         
     
     SemaphoreFree(clerksDone); // this semaphore is not needed anymore
-    SemaphoreWait(line.lock); // binary lock to protect global
-    myPlace = line.nextPlaceInLine++; // get number & update line count
-    SemaphoreSignal(line.lock);
+    QueueLockAcquire(line.order); // wait our turn at the register
+    SemaphoreSignal(line.customerReady); // signal to cashier we are here
+    SemaphoreWait(line.checkedOut); // wait til checked through
+    QueueLockRelease(line.order); // next in line, please
     
-    SemaphoreSignal(line.customerReady); // signal to cashier we are in line
-    SemaphoreWait(line.customers[myPlace]); // wait til checked through
-    
-    printf("%s done!\n", ThreadName());
-    SemaphoreSignal(FinishedThread);
+    ThreadLog("%s done!\n", ThreadName());
 }
 /*
  * The cashier just checks the customers through, one at a time,
- * as they become ready. In order to ensure that the customers get
- * processed in order, we maintain an array of semaphores that allow us
- * to selectively notify a waiting customer, rather than signaling
- * one combined semaphore without any control over which waiter will
- * get notified.
+ * as they become ready. The queue lock makes sure only the customer
+ * at the front of the line is at the register, so one checkedOut
+ * semaphore is enough: there is never more than one customer waiting
+ * on it, and the lock hands the register to customers in the order
+ * they lined up.
  */
 static void Cashier(void)
 {
     int i;
-    for (i = 0; i < NUM_CUSTOMERS; i++) {
+    for (i = 0; i < numCustomers; i++) {
         SemaphoreWait(line.customerReady);
         Checkout(i);
-        SemaphoreSignal(line.customers[i]);
+        SemaphoreSignal(line.checkedOut);
     }
 
 }
@@ -207,62 +235,50 @@ static void Cashier(void)
  */
 static void SetupSemaphores(void)
 {
-    int i;
-    inspection.requested = SemaphoreNew("Inspection Requested", 0);
-    inspection.finished = SemaphoreNew("Inspection Finished", 0);
-    inspection.available = SemaphoreNew("Manager Available", 1);
-    inspection.passed = false;
+    inspection.requests = MailboxNew("Inspection Requests");
+    atomic_init(&inspection.numPerfect, 0);
+    line.order = QueueLockNew("Checkout line");
     line.customerReady = SemaphoreNew("Customer ready", 0);
-    line.lock = SemaphoreNew("Line lock", 1);
-    line.nextPlaceInLine = 0;
-    for (i = 0; i < NUM_CUSTOMERS; i++)
-        line.customers[i] = SemaphoreNew("Customer in line", 0);
+    line.checkedOut = SemaphoreNew("Checked out", 0);
 }
 
 static void FreeSemaphores(void)
 {
-    int i;
-    SemaphoreFree(inspection.requested);
-    SemaphoreFree(inspection.finished);
-    SemaphoreFree(inspection.available);
+    MailboxFree(inspection.requests);
+    QueueLockFree(line.order);
     SemaphoreFree(line.customerReady);
-    SemaphoreFree(line.lock);
-    for (i = 0; i < NUM_CUSTOMERS; i++)
-        SemaphoreFree(line.customers[i]);
+    SemaphoreFree(line.checkedOut);
 }
 /* These are just fake functions to stand in for processing steps */
 static void MakeCone(void)
 {
-    //ThreadSleep(RandomInteger(0, 3*SECOND)); // sleep random amount
-    printf("\t%s making an ice cream cone.\n", ThreadName());
+    ThreadSleep(RandomInteger(0, 3*SECOND)); // sleep random amount
+    ThreadLog("\t%s making an ice cream cone.\n", ThreadName());
 }
 static bool InspectCone(void)
 {
     bool passed = (RandomInteger(1, 2) == 1);
-    printf("\t\t%s examining cone, did it pass? %c\n", ThreadName(), (passed ? 'Y':'N'));
-    //ThreadSleep(RandomInteger(0, .5*SECOND)); // sleep random amount
+    ThreadLog("\t\t%s examining cone, did it pass? %c\n", ThreadName(), (passed ? 'Y':'N'));
+    ThreadSleep(RandomInteger(0, .5*SECOND)); // sleep random amount
     return passed;
 }
 static void Checkout(int linePosition)
 {
-    printf("\t\t\t%s checking out customer in line at position #%d.\n", ThreadName(), linePosition);
-    //ThreadSleep(RandomInteger(0, SECOND)); // sleep random amount
+    ThreadLog("\t\t\t%s checking out customer in line at position #%d.\n", ThreadName(), linePosition);
+    ThreadSleep(RandomInteger(0, SECOND)); // sleep random amount
 }
 static void Browse(void)
 {
-    //ThreadSleep(RandomInteger(0, 5*SECOND)); // sleep random amount
-    printf("%s browsing.\n", ThreadName());
+    ThreadSleep(RandomInteger(0, 5*SECOND)); // sleep random amount
+    ThreadLog("%s browsing.\n", ThreadName());
 }
 /*
  * RandomInteger
  * -------------
- * Simple random integer function.
+ * Simple random integer function. Every thread draws from a generator of
+ * its own, so no lock is needed and the draws are the same on every run.
  */
 static int RandomInteger(int low, int high)
 {
-    extern long random();
-    long choice;
-    int range = high - low + 1;
-    PROTECT(choice = random()); // protect non-re-entrant random
-    return low + choice % range;
+    return (int)ThreadRandomRange(low, high);
 }
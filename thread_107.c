@@ -1,319 +1,4971 @@
+#ifdef __linux__
+#define _GNU_SOURCE // cpu_set_t, sched_getaffinity and pthread_setaffinity_np
+#endif
 #include "thread_107.h"
-#include <fcntl.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <pthread.h>
-#ifdef __APPLE__
-#include <dispatch/dispatch.h>
-#else
-#include <semaphore.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #endif
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <errno.h>
+#include <sys/mman.h>
+
+// number of times SemaphoreWait polls the counter before parking in the kernel
+#define SEMAPHORE_SPIN_LIMIT 100
+// how many holders waiting on one another priority inheritance follows
+#define PRIORITY_CHAIN_DEPTH 8
+// keeps independently written atomics from sharing a cache line
+#define CACHE_LINE_SIZE 64
+
+// a task run as a green thread, see UseGreenThreads.
+typedef struct GreenThread GreenThread;
+
+// a pending SemaphoreWaitAsync, one slab object each.
+typedef struct AsyncWaiter {
+    struct AsyncWaiter *next;
+    void (*resume)(void *);
+    void *context;
+    uint64_t queuedAt; // for the contention stats, 0 when they are off
+} AsyncWaiter;
+
+// contention counters of one semaphore, only allocated when stats are on.
+typedef struct {
+    atomic_ulong acquisitions;
+    atomic_ulong contendedWaits;
+    atomic_ullong totalBlockedNs;
+    atomic_ullong maxBlockedNs;
+    atomic_ulong waitHistogram[SEMAPHORE_HISTOGRAM_BUCKETS];
+} SemaphoreCounters;
+
+struct SemaphoreImplementation {
+    atomic_int value; // the semaphore count, never negative
+    atomic_int waiters; // number of threads parked (or about to park) on value
+    int index; // slot in threadPool.semaphores, for O(1) unregister
+    SemaphoreCounters *stats; // NULL unless EnableSemaphoreStats(true) was called
+    uint32_t traceId; // identifies the semaphore in traces, never reused
+    atomic_int greenWaiters; // green threads parked in the list below
+    GreenThread *greenHead; // FIFO of parked green threads, guarded by InternalLockFor(semaphore)
+    GreenThread *greenTail;
+    atomic_int asyncWaiters; // pending SemaphoreWaitAsync calls in the list below
+    AsyncWaiter *asyncHead; // FIFO, guarded by InternalLockFor(semaphore) as well
+    AsyncWaiter *asyncTail;
+    bool prioritized; // made by SemaphoreNewPrioritized, every wait queues below
+    bool inherits; // prioritized with initial value 1: its holder inherits its waiters' priority
+    struct PriorityWaiter *priorityHead; // highest priority first, FIFO among equals, under InternalLockFor(semaphore)
+    struct PriorityWaiter *priorityTail;
+    struct ThreadInfo *owner; // task holding an inheriting semaphore, NULL if none, under InternalLockFor(semaphore)
+    struct SemaphoreImplementation *heldNext; // next inheriting semaphore its owner holds, under owner->heldLock
+    atomic_int lent; // priority of the first queued waiter, what the owner inherits from this semaphore
+    char debugName[]; // allocated together with the semaphore
+};
+
+// a thread blocked on a prioritized semaphore, on the waiter's stack.
+typedef struct PriorityWaiter {
+    struct PriorityWaiter *next;
+    struct ThreadInfo *t_info; // NULL outside tasks
+    int priority; // effective priority when it queued
+    bool granted; // a signal handed it a unit, guarded by InternalLockFor(semaphore)
+    atomic_int state; // QUEUE_WAITING until granted, threads outside tasks sleep on it
+    Semaphore parker; // tasks block on TaskParker instead
+} PriorityWaiter;
+
+struct WaitGroupImplementation {
+    atomic_int count; // outstanding completions, the waiter sleeps on it
+    atomic_int waiters; // threads parked in WaitGroupWait
+};
+
+// futex mutex padded to its own cache line (0 free, 1 held, 2 held + waiters).
+struct LockImplementation {
+    _Alignas(CACHE_LINE_SIZE) atomic_int state;
+    const char *debugName; // NULL for the striped locks returned by LockFor
+};
+
+// reader-writer lock: every reader counts itself in one of mask + 1 slots,
+// each on its own cache line, so readers on different slots never write the
+// same line. A writer announces itself in writer and waits for all slots to
+// drain.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_int readers;
+} RWLockSlot;
+
+enum {
+    RWLOCK_FREE = 0,
+    RWLOCK_PENDING = 1, // a writer is draining the readers
+    RWLOCK_HELD = 2 // a writer holds the lock
+};
+
+struct RWLockImplementation {
+    _Alignas(CACHE_LINE_SIZE) atomic_int writer; // RWLOCK_*, blocked readers sleep on it
+    atomic_int readerWaiters;
+    bool preferWriters; // readers back off from pending writers too
+    int mask; // number of slots - 1, a power of two
+    struct LockImplementation writerLock; // serializes writers
+    _Alignas(CACHE_LINE_SIZE) atomic_int drainEvents; // bumped when a slot drains under a writer
+    atomic_int drainWaiters;
+    const char *debugName;
+    RWLockSlot *slots;
+};
+
+// a bounded count handed out in batches: threads lease tokens into their
+// ThreadInfo's TokenCache with one atomic subtraction and then take them
+// one by one without touching the shared line.
+struct TokenPoolImplementation {
+    _Alignas(CACHE_LINE_SIZE) atomic_long remaining; // not leased to any thread yet
+    const char *debugName;
+};
+
+typedef struct {
+    struct TokenPoolImplementation *pool; // NULL if the entry is unused
+    long count; // leased tokens not taken yet
+    long batch; // size of the next lease, grows while leases come easily
+} TokenCache;
+
+// pools a thread caches tokens from at once, a further pool evicts one
+#define TOKEN_CACHE_WAYS 4
+// smallest and largest lease, and how far a lease may dig into what is left:
+// at most remaining / TOKEN_LEASE_SHARE, so near exhaustion tokens are claimed
+// one at a time and no thread sits on tokens another could sell.
+#define TOKEN_LEASE_MIN 8
+#define TOKEN_LEASE_MAX 4096
+#define TOKEN_LEASE_SHARE 64
+
+// one request in flight: it lives on the calling client's stack, which is
+// blocked on replied until a server answers it.
+struct MailboxEnvelopeImplementation {
+    void *request;
+    void *reply;
+    Semaphore replied; // the client task's reply semaphore
+    bool temporary; // replied is freed after this call, see MailboxReply
+    atomic_bool released; // the server is done with replied
+    struct MailboxEnvelopeImplementation *next; // FIFO link in the mailbox queue
+};
+
+// requests queue up in FIFO order under lock, pending counts them for the servers.
+struct MailboxImplementation {
+    struct LockImplementation lock;
+    MailboxEnvelope head;
+    MailboxEnvelope tail;
+    bool closed; // MailboxCall fails and servers get NULL once the queue is empty
+    Semaphore pending; // one unit per queued request, plus one after MailboxClose
+    const char *debugName;
+};
+
+// MCS queue lock: every waiter appends its own node to the tail and waits
+// on that node only, the holder hands the lock straight to its successor.
+// Nodes come from the slab (one cache line each) and are freed on release.
+typedef struct QueueNode {
+    _Alignas(CACHE_LINE_SIZE) _Atomic(struct QueueNode *) next; // successor, set once it has queued
+    atomic_int state; // QUEUE_*, OS threads outside tasks sleep on it
+    Semaphore parker; // the waiting task's TaskParker, NULL outside tasks
+} QueueNode;
+
+enum {
+    QUEUE_WAITING = 0,
+    QUEUE_GRANTED = 1,
+    QUEUE_PARKED = 2 // waiting and asleep in FutexWait
+};
+
+struct QueueLockImplementation {
+    _Alignas(CACHE_LINE_SIZE) _Atomic(QueueNode *) tail; // last waiter, NULL when free
+    QueueNode *holder; // node of the current holder, only the holder touches it
+    const char *debugName;
+};
+
+// one counter of a Barrier's combining tree. word holds the generation the
+// node is counting for in its upper half and the arrivals so far in the
+// lower half; whoever fills it re-arms it for the next generation, so late
+// arrivals of the current one can not slip in and nothing needs resetting.
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_ullong word;
+    int capacity; // arrivals that fill it: parties at a leaf, children above
+    int parent; // index in nodes, -1 at the root
+} BarrierNode;
+
+// sense-reversing barrier: a phase ends when the root node fills, and its
+// filler bumps generation, which everybody else waits on. Up to
+// BARRIER_TREE_MIN parties share a single node, beyond that they arrive at
+// the leaves of a tree with fan-in BARRIER_FANIN.
+struct BarrierImplementation {
+    _Alignas(CACHE_LINE_SIZE) atomic_int generation; // OS threads futex-wait on it
+    atomic_int sleepers; // threads in FutexWait on generation
+    int greenParked; // green threads waiting on a gate, guarded by InternalLockFor(barrier)
+    // green threads of generation g wait on gates[g & 1], so a thread that
+    // has already moved on to the next phase can not take a unit meant for
+    // one still asleep in the last.
+    Semaphore gates[2];
+    int parties;
+    int spinLimit; // polls of generation before parking, 0 if the parties outnumber the CPUs
+    int nLeaves; // nodes[0 .. nLeaves) are leaves, the root is the last node
+    int nNodes;
+    BarrierNode *nodes;
+    const char *debugName;
+};
 
+#define BARRIER_FANIN 8
+#define BARRIER_TREE_MIN 16
+#define BARRIER_SPIN_LIMIT 2000 // polls of generation before parking
+
+// LockFor shares 2^LOCK_STRIPE_BITS striped locks among all addresses
+#define LOCK_STRIPE_BITS 8
+#define LOCK_STRIPES (1 << LOCK_STRIPE_BITS)
+// upper bound on the reader slots of one RWLock
+#define RWLOCK_MAX_SLOTS 256
+
+// one slot of a Channel ring, the payload follows the sequence number.
+typedef struct {
+    atomic_size_t sequence; // == position when free, position + 1 when full
+} ChannelCell;
+
+// bounded MPMC ring with per-slot sequence numbers (Vyukov's algorithm).
+// Blocked senders/receivers park on an event counter that is bumped per
+// element, so the kernel is only entered when somebody is really parked.
+struct ChannelImplementation {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueuePos;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeuePos;
+    _Alignas(CACHE_LINE_SIZE) atomic_int sendEvents; // bumped when a slot is freed
+    atomic_int sendWaiters;
+    _Alignas(CACHE_LINE_SIZE) atomic_int receiveEvents; // bumped when a slot is filled
+    atomic_int receiveWaiters;
+    _Alignas(CACHE_LINE_SIZE) size_t mask; // capacity - 1, capacity is a power of two
+    size_t elemSize;
+    size_t cellSize;
+    char *cells;
+    char debugName[];
+};
+
+// header in front of every ByteChannel record. The tag carries the record's
+// ring position as well as its state, so a header left over from an earlier
+// lap around the ring can never be mistaken for the current one.
+typedef struct {
+    _Atomic uint64_t tag; // BYTE_RECORD_TAG(position, state)
+    uint32_t total; // bytes the record occupies in the ring, header included
+    uint32_t length; // committed payload length
+} ByteRecord;
+
+enum {
+    BYTE_RECORD_RESERVED = 0, // being written by a producer
+    BYTE_RECORD_COMMITTED = 1, // ready for a consumer
+    BYTE_RECORD_PADDING = 2, // filler up to the end of the ring, skipped
+    BYTE_RECORD_RELEASED = 3 // done with, waiting for releasePos to pass it
+};
+#define BYTE_RECORD_TAG(pos, state) (((uint64_t)(pos) << 2) | (state))
+#define BYTE_RECORD_ALIGN 16
+
+// variable-size record ring: producers reserve contiguous regions and fill
+// them in place, consumers read them in place, FIFO. Positions only grow;
+// [releasePos, readPos) is being read, [readPos, reservePos) is queued.
+struct ByteChannelImplementation {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t reservePos; // advanced under reserveLock
+    pthread_mutex_t reserveLock; // held only to claim space and write headers
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t readPos; // consumers claim records with CAS
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t releasePos; // bytes before it are free
+    _Alignas(CACHE_LINE_SIZE) atomic_int spaceEvents; // bumped when releasePos moves
+    atomic_int spaceWaiters;
+    _Alignas(CACHE_LINE_SIZE) atomic_int dataEvents; // bumped when a record is committed
+    atomic_int dataWaiters;
+    _Alignas(CACHE_LINE_SIZE) uint64_t capacity; // power of two
+    char *ring;
+    char debugName[];
+};
+
+// CPUs a thread is pinned to, cpus[0] is the one ThreadPlaceNear shares caches with.
 typedef struct {
+    int nCpus;
+    int cpus[];
+} Placement;
+
+typedef struct ThreadInfo {
     const char *debugName;
     void *(*func)(void *);
     void *args;
     int nArg;
-    pthread_t tid;
+    int index; // slot in threadPool.threadInfos, identifies the task in traces
+    size_t allocSize; // one slab object holds the descriptor, args and debugName
+    pthread_t tid; // the OS thread running (or that ran) this task
+    bool joinable; // tid is a thread of its own that JoinAllThreads must reap
+    Placement *placement; // NULL lets the kernel schedule it freely
+    struct ThreadInfo *next; // link in the worker pool's run queue
+    TokenCache tokens[TOKEN_CACHE_WAYS]; // leased from TokenPools, returned when the task ends
+    Semaphore parker; // MailboxCall and QueueLockAcquire block on it, created on first use
+    uint64_t random[4]; // xoshiro256** state of ThreadRandom, all zero until the first draw
+    atomic_int priority; // from ThreadNewPrioritized or ThreadSetPriority, 0 by default
+    atomic_int boost; // inherited from waiters on a semaphore it holds, 0 if none
+    _Atomic(Semaphore) blockedOn; // prioritized semaphore it waits on, to pass inheritance on
+    struct LockImplementation heldLock; // guards held, taken after a semaphore's lock, never before
+    Semaphore held; // inheriting semaphores it holds, linked by heldNext
 } ThreadInfo;
 
+// growable array of pointers built from segments that double in size, so
+// growing it never moves existing slots and lookups stay O(1).
+#define REGISTRY_FIRST_SEGMENT 16
+#define REGISTRY_SEGMENTS 26
+typedef struct {
+    void **segments[REGISTRY_SEGMENTS]; // segment k has REGISTRY_FIRST_SEGMENT << k slots
+} Registry;
+
 typedef struct {
     int logicalLength;
-    int allocatedLength;
-    ThreadInfo *threadInfos;
-    Semaphore *semaphores;
+    Registry threadInfos; // ThreadInfo *, each descriptor is allocated once and never moves
+    Registry semaphores; // Semaphore
     int semLogicalLength;
-    int semAllocatedLength;
+    bool running; // RunAllThreads was called, later ThreadNew calls start at once
 } ThreadPool;
 
+// opt-in pool of OS threads that run ThreadNew tasks in FIFO order.
+typedef struct {
+    int numWorkers; // 0 means pool mode is off
+    pthread_t *workers;
+    ThreadInfo *head; // run queue of tasks not yet picked by a worker
+    ThreadInfo *tail;
+    bool shuttingDown;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+} WorkerPool;
+
 static bool traceFlag = true; // default value of traceFlag is true.
+static bool statsFlag = false; // SemaphoreNew attaches contention counters
 static pthread_mutex_t mutexLock; // mutex lock for AcquireLibraryLock API
 static pthread_mutex_t threadNewLock; // mutex lock to protect shared infomations in threadPool when calling the ThreadNew
 static pthread_mutex_t semaphoreNewLock; // mutex lock to protect shared infomations in threadPool when calling the SemaphoreNew
+static struct LockImplementation lockStripes[LOCK_STRIPES]; // zero-initialized, i.e. unlocked
+// the library's own stripes, apart from lockStripes so that a caller holding
+// PROTECT_ADDRESS(&x, ...) around a semaphore or barrier call cannot deadlock
+// against the library taking the same stripe inside it.
+static struct LockImplementation internalStripes[LOCK_STRIPES];
+
+static inline Lock InternalLockFor(const void *address)
+{
+    uint64_t hash = ((uint64_t)(uintptr_t)address >> 3) * 0x9E3779B97F4A7C15ull;
+    return &internalStripes[hash >> (64 - LOCK_STRIPE_BITS)];
+}
 
 // extern threadPool from thread_107.h.
 static ThreadPool threadPool;
+static WorkerPool workerPool;
+// one count per launched task that has not returned yet, see JoinAllThreads.
+static struct WaitGroupImplementation threadsAlive;
 
-// for thread safety, you can call InitThreadPackage function only once in one thread(normally it will be the main thread)
-void InitThreadPackage(bool flag)
+// descriptor of the calling thread, set by ThreadTrampoline, NULL for threads
+// not started through RunAllThreads (e.g. the main thread).
+static __thread ThreadInfo *currentThread = NULL;
+
+// a requested priority within 0..THREAD_PRIORITY_MAX.
+static inline int PriorityClamp(int priority)
 {
-    traceFlag = flag;
-    threadPool.logicalLength = 0;
-    threadPool.allocatedLength = 4;
-    threadPool.threadInfos = malloc(sizeof(ThreadInfo) * threadPool.allocatedLength);
-    threadPool.semLogicalLength = 0;
-    threadPool.semAllocatedLength = 4;
-    threadPool.semaphores = malloc(sizeof(Semaphore) * threadPool.semAllocatedLength);
+    if (priority < 0) return 0;
+    return priority > THREAD_PRIORITY_MAX ? THREAD_PRIORITY_MAX : priority;
+}
 
-    // init mutexLock
-    int inited = pthread_mutex_init(&mutexLock, NULL);
-    if (inited != 0) perror("pthread_mutex_init error");
+// the priority a task is queued and scheduled with, 0 outside tasks.
+static inline int ThreadEffectivePriority(ThreadInfo *t_info)
+{
+    if (t_info == NULL) return 0;
+    int priority = atomic_load_explicit(&t_info->priority, memory_order_relaxed);
+    int boost = atomic_load_explicit(&t_info->boost, memory_order_relaxed);
+    return boost > priority ? boost : priority;
+}
 
-    // init threadNewLock
-    inited = pthread_mutex_init(&threadNewLock, NULL);
-    if (inited != 0) perror("pthread_mutex_init error");
+// deadline meaning "never time out"
+#define FUTEX_FOREVER UINT64_MAX
 
-    // init semaphoreNewLock
-    inited = pthread_mutex_init(&semaphoreNewLock, NULL);
-    if (inited != 0) perror("pthread_mutex_init error");
+static inline uint64_t MonotonicNanos(void);
+static void TokenCacheFlush(ThreadInfo *t_info);
+static Semaphore TaskParker(void);
+static bool SemaphoreWaitInternal(Semaphore s, uint64_t deadlineNs);
+static bool PrioritySemaphoreWait(Semaphore s, uint64_t deadlineNs, SemaphoreCounters *stats);
+static bool PrioritySemaphoreTryWait(Semaphore s);
+static void PrioritySemaphoreSignal(Semaphore s);
+// block while *addr == expected, returns on wake, value change or signal.
+static void FutexWait(atomic_int *addr, int expected);
+// same, but gives up at deadlineNs on CLOCK_MONOTONIC; false only on timeout.
+static bool FutexWaitUntil(atomic_int *addr, int expected, uint64_t deadlineNs);
+// wake up to n threads blocked in FutexWait on addr.
+static void FutexWake(atomic_int *addr, int n);
+
+static void FutexWait(atomic_int *addr, int expected)
+{
+    FutexWaitUntil(addr, expected, FUTEX_FOREVER);
 }
 
-// for thread safety, you can call FreeThreadPackage function only once in one thread(normally it will be the main thread)
-void FreeThreadPackage()
+#ifdef __linux__
+static bool FutexWaitUntil(atomic_int *addr, int expected, uint64_t deadlineNs)
 {
-    // free ThreadInfo's debugName and args.
-    for (int i = 0; i < threadPool.logicalLength; i++)
-    {
-        ThreadInfo *t_info = &(threadPool.threadInfos[i]);
-        free((void *)t_info->debugName);
-        free(t_info->args);
-    }
-    
-    // free the whole threadInfos
-    free(threadPool.threadInfos);
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline.
+    struct timespec deadline = { .tv_sec = (time_t)(deadlineNs / 1000000000ull),
+                                 .tv_nsec = (long)(deadlineNs % 1000000000ull) };
+    long result = syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, expected,
+                          deadlineNs == FUTEX_FOREVER ? NULL : &deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    if (result == 0 || errno == EAGAIN || errno == EINTR) return true;
+    if (errno == ETIMEDOUT) return false;
+    perror("futex wait error");
+    return true;
+}
 
-    // free all Semaphores.
-    for (int i = 0; i < threadPool.semLogicalLength; i++)
+static void FutexWake(atomic_int *addr, int n)
+{
+    long result = syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+    if (result < 0) perror("futex wake error");
+}
+#elif defined(__APPLE__)
+// darwin's futex equivalent, exported by libSystem since macOS 10.12.
+extern int __ulock_wait(uint32_t operation, void *addr, uint64_t value, uint32_t timeout);
+extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wakeValue);
+#define UL_COMPARE_AND_WAIT 1
+#define ULF_WAKE_ALL 0x00000100
+
+static bool FutexWaitUntil(atomic_int *addr, int expected, uint64_t deadlineNs)
+{
+    // __ulock_wait takes a relative timeout in microseconds, 0 means forever.
+    uint32_t timeoutUs = 0;
+    if (deadlineNs != FUTEX_FOREVER)
     {
-        Semaphore semaphore = threadPool.semaphores[i];
-        SemaphoreFree(semaphore);
+        uint64_t now = MonotonicNanos();
+        if (now >= deadlineNs) return false;
+        uint64_t remainingUs = (deadlineNs - now + 999) / 1000;
+        timeoutUs = remainingUs > UINT32_MAX ? UINT32_MAX : (uint32_t)remainingUs;
     }
+    int result = __ulock_wait(UL_COMPARE_AND_WAIT, addr, (uint64_t)expected, timeoutUs);
+    if (result >= 0 || errno == EINTR || errno == EFAULT) return true;
+    if (errno == ETIMEDOUT) return false;
+    perror("__ulock_wait error");
+    return true;
+}
 
-    // free the whole semaphores
-    free(threadPool.semaphores);
-
-    // free mutexLock
-    int destoryed = pthread_mutex_destroy(&mutexLock);
-    if (destoryed != 0) perror("pthread_mutex_destory error");
-
-    // free threadNewLock
-    destoryed = pthread_mutex_destroy(&threadNewLock);
-    if (destoryed != 0) perror("pthread_mutex_destory error");
+static void FutexWake(atomic_int *addr, int n)
+{
+    int result = __ulock_wake(UL_COMPARE_AND_WAIT | (n > 1 ? ULF_WAKE_ALL : 0), addr, 0);
+    if (result < 0 && errno != ENOENT) perror("__ulock_wake error");
+}
+#else
+#error "thread_107 needs futex (linux) or __ulock (macOS) support"
+#endif
 
-    // free semaphoreNewLock
-    destoryed = pthread_mutex_destroy(&semaphoreNewLock);
-    if (destoryed != 0) perror("pthread_mutex_destory error");
+static inline void CpuRelax(void)
+{
+    #if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+    #elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+    #endif
 }
 
-void ThreadNew(const char *debugName, void *(*func)(void *), int nArg, ...)
+static inline uint64_t MonotonicNanos(void)
 {
-    // variable-argument function, only accepts pointer(actually void *) as non-name arguments.
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
 
-    // confirm that only one thread can call this function every single time
-    int locked = pthread_mutex_lock(&threadNewLock);
-    if (locked != 0) perror("pthread_mutex_lock error");
+// ---------------------------------------------------------------------------
+// slab allocator for ThreadInfo and Semaphore objects.
+//
+// Objects come in power-of-two size classes. Each thread keeps a free list
+// per class, refilled in batches carved out of a shared arena of large
+// chunks, and freed objects go back to the freeing thread's list. Objects
+// are often freed by another thread than the one that allocated them (async
+// waiters, queue nodes, mailbox replies), so a list that grows past two
+// batches hands a batch to a shared per-class depot, and refills take from
+// the depot before carving new memory; a thread that exits hands back its
+// whole cache. So in steady state creating and freeing objects never
+// touches the heap, and FreeThreadPackage releases the whole arena in one shot.
+// ---------------------------------------------------------------------------
 
-    // expand the threadInfos
-    if (threadPool.logicalLength == threadPool.allocatedLength)
-    {
-        threadPool.threadInfos = realloc(threadPool.threadInfos,
-                                        sizeof(ThreadInfo) * threadPool.allocatedLength * 2);
-        if (threadPool.threadInfos == NULL) {
-            printf("errorno is: %d\n", errno);
-            perror("realloc error\n");
-        }
-        threadPool.allocatedLength *= 2;
-    }
+#define SLAB_MIN_SHIFT 5 // smallest class is 32 bytes
+#define SLAB_CLASSES 6 // 32 .. 1024 bytes, larger objects use malloc
+#define SLAB_REFILL_BYTES 4096 // carved from the arena per refill
+#define ARENA_CHUNK_BYTES (256 * 1024)
 
-    ThreadInfo t_info;
-    t_info.debugName = malloc(strlen(debugName) + 1);
-    strcpy(t_info.debugName, debugName);
-    t_info.func = func;
-    t_info.nArg = nArg;
-    t_info.args = malloc(sizeof(char *));
+typedef struct SlabObject {
+    struct SlabObject *next;
+    // only in the first object of a batch in slabDepot:
+    struct SlabObject *nextBatch;
+    size_t batchSize;
+} SlabObject;
 
-    if (nArg != 0)
-    {
-        t_info.args = malloc((nArg + 1) * sizeof(void *));
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t used;
+    _Alignas(CACHE_LINE_SIZE) char data[ARENA_CHUNK_BYTES]; // classes >= 64 bytes never straddle a line
+} ArenaChunk;
+
+static pthread_mutex_t arenaLock = PTHREAD_MUTEX_INITIALIZER; // guards arenaChunks and slabDepot
+static ArenaChunk *arenaChunks; // newest first, only the head has room left
+static SlabObject *slabDepot[SLAB_CLASSES]; // batches given back by other threads' caches
+static atomic_uint arenaGeneration; // bumped when the arena is released
+static __thread SlabObject *slabCache[SLAB_CLASSES];
+static __thread size_t slabCount[SLAB_CLASSES]; // objects in slabCache
+static __thread unsigned slabGeneration; // arena generation slabCache belongs to
+
+static inline int SlabClass(size_t size)
+{
+    int shift = SLAB_MIN_SHIFT;
+    while (((size_t)1 << shift) < size) shift++;
+    return shift - SLAB_MIN_SHIFT;
+}
 
-        va_list ap;
-        va_start(ap, nArg);
+// move a batch of class-sized objects from the depot, else from the arena,
+// into this thread's cache.
+static bool SlabRefill(int sizeClass)
+{
+    size_t objectSize = (size_t)1 << (sizeClass + SLAB_MIN_SHIFT);
 
-        for (int i = 0; i < nArg; i++)
+    pthread_mutex_lock(&arenaLock);
+    SlabObject *batch = slabDepot[sizeClass];
+    if (batch != NULL)
+    {
+        slabDepot[sizeClass] = batch->nextBatch;
+        pthread_mutex_unlock(&arenaLock);
+        slabCache[sizeClass] = batch;
+        slabCount[sizeClass] = batch->batchSize;
+        return true;
+    }
+    ArenaChunk *chunk = arenaChunks;
+    if (chunk == NULL || chunk->used + SLAB_REFILL_BYTES > ARENA_CHUNK_BYTES)
+    {
+        if (posix_memalign((void **)&chunk, CACHE_LINE_SIZE, sizeof(ArenaChunk)) != 0)
         {
-            void *v = va_arg(ap, void *);
-            memcpy(&(((void **)t_info.args)[i + 1]), &v, sizeof(void *));
+            pthread_mutex_unlock(&arenaLock);
+            perror("posix_memalign error");
+            return false;
         }
-        va_end(ap);
+        chunk->used = 0;
+        chunk->next = arenaChunks;
+        arenaChunks = chunk;
     }
+    char *carved = chunk->data + chunk->used;
+    chunk->used += SLAB_REFILL_BYTES;
+    pthread_mutex_unlock(&arenaLock);
 
-    // copy debugName to t_info.args[0].
-    memcpy(t_info.args, &t_info.debugName, sizeof(char *));
+    for (size_t offset = 0; offset + objectSize <= SLAB_REFILL_BYTES; offset += objectSize)
+    {
+        SlabObject *object = (SlabObject *)(carved + offset);
+        object->next = slabCache[sizeClass];
+        slabCache[sizeClass] = object;
+        slabCount[sizeClass]++;
+    }
+    return true;
+}
 
-    // copy mem from loacl var to heap mem for data persistence.
-    memcpy(&(threadPool.threadInfos[threadPool.logicalLength]), &t_info, sizeof(ThreadInfo));
-    threadPool.logicalLength ++;
+// hand the first count objects of this thread's cache to the depot.
+static void SlabSpill(int sizeClass, size_t count)
+{
+    SlabObject *batch = slabCache[sizeClass];
+    SlabObject *last = batch;
+    for (size_t i = 1; i < count; i++) last = last->next;
+    slabCache[sizeClass] = last->next;
+    slabCount[sizeClass] -= count;
+    last->next = NULL;
+    batch->batchSize = count;
 
-    int unlocked = pthread_mutex_unlock(&threadNewLock);
-    if (unlocked != 0) perror("pthread_mutex_unlock error");
+    pthread_mutex_lock(&arenaLock);
+    batch->nextBatch = slabDepot[sizeClass];
+    slabDepot[sizeClass] = batch;
+    pthread_mutex_unlock(&arenaLock);
 }
 
-void ThreadSleep(int microSecs)
+// give this thread's whole cache to the depot, before the thread exits.
+static void SlabFlush(void)
 {
-    struct timespec {
-        time_t tv_sec;
-        long tv_nsec;
-    };
-    struct timespec sleeper = { .tv_sec = microSecs / 1000, .tv_nsec = (microSecs % 1000) * 10e6L };
-
-    
-    printf("%d \n", sleeper.tv_sec);
-    if (nanosleep(&sleeper, NULL) != 0) perror("sleep error");
+    if (slabGeneration != atomic_load_explicit(&arenaGeneration, memory_order_acquire)) return;
+    for (int sizeClass = 0; sizeClass < SLAB_CLASSES; sizeClass++)
+    {
+        if (slabCount[sizeClass] > 0) SlabSpill(sizeClass, slabCount[sizeClass]);
+    }
 }
 
-// macOS can not get name of single thread.
-const char *ThreadName(void)
+static void *SlabAlloc(size_t size)
 {
-    pthread_t tid = pthread_self();
-    const char *debugName = NULL;
+    int sizeClass = SlabClass(size);
+    if (sizeClass >= SLAB_CLASSES) return malloc(size);
 
-    // confirm that only one thread can call this function every single time
-    int locked = pthread_mutex_lock(&threadNewLock);
-    if (locked != 0) perror("pthread_mutex_lock error");
+    // the cache of a thread that outlived FreeThreadPackage points into freed chunks.
+    unsigned generation = atomic_load_explicit(&arenaGeneration, memory_order_acquire);
+    if (slabGeneration != generation)
+    {
+        memset(slabCache, 0, sizeof(slabCache));
+        memset(slabCount, 0, sizeof(slabCount));
+        slabGeneration = generation;
+    }
 
-    for (int i = 0; i < threadPool.logicalLength; i++)
+    if (slabCache[sizeClass] == NULL && !SlabRefill(sizeClass)) return NULL;
+    SlabObject *object = slabCache[sizeClass];
+    slabCache[sizeClass] = object->next;
+    slabCount[sizeClass]--;
+    return object;
+}
+
+// size must be the size the object was allocated with.
+static void SlabRelease(void *object, size_t size)
+{
+    int sizeClass = SlabClass(size);
+    if (sizeClass >= SLAB_CLASSES)
     {
-        ThreadInfo t_info = threadPool.threadInfos[i];
-        if (t_info.tid == tid) debugName = t_info.debugName;
+        free(object);
+        return;
     }
+    if (slabGeneration != atomic_load_explicit(&arenaGeneration, memory_order_acquire)) return;
 
-    int unlocked = pthread_mutex_unlock(&threadNewLock);
-    if (unlocked != 0) perror("pthread_mutex_unlock error");
+    SlabObject *released = object;
+    released->next = slabCache[sizeClass];
+    slabCache[sizeClass] = released;
 
-    return debugName;
+    // objects freed here but allocated elsewhere would pile up: pass a batch on.
+    size_t batchSize = SLAB_REFILL_BYTES >> (sizeClass + SLAB_MIN_SHIFT);
+    if (++slabCount[sizeClass] > 2 * batchSize) SlabSpill(sizeClass, batchSize);
 }
 
-// for thread safety, you can call RunAllThreads function only once in one thread(normally it will be the main thread)
-void RunAllThreads(void)
+// free every chunk at once, all slab objects die with them.
+static void ArenaReleaseAll(void)
 {
-    for (int i = 0; i < threadPool.logicalLength; i++)
+    pthread_mutex_lock(&arenaLock);
+    while (arenaChunks != NULL)
     {
-        pthread_t tid;
-        ThreadInfo *t_info = &(threadPool.threadInfos[i]);
-        t_info->tid = tid;
-        if (pthread_create(&(t_info->tid), NULL, t_info->func, t_info->args) != 0) perror("pthread_create error");
+        ArenaChunk *next = arenaChunks->next;
+        free(arenaChunks);
+        arenaChunks = next;
     }
+    memset(slabDepot, 0, sizeof(slabDepot));
+    atomic_fetch_add_explicit(&arenaGeneration, 1, memory_order_release);
+    pthread_mutex_unlock(&arenaLock);
 }
 
-Semaphore SemaphoreNew(const char *debugName, int initialValue)
+static inline void **RegistrySlot(Registry *registry, int index)
 {
-    // confirm that only one thread can call this function every single time
-    int locked = pthread_mutex_lock(&semaphoreNewLock);
-    if (locked != 0) perror("pthread_mutex_lock error");
+    // index + FIRST lies in [FIRST << k, FIRST << (k + 1)) for segment k.
+    unsigned biased = (unsigned)index + REGISTRY_FIRST_SEGMENT;
+    int segment = (31 - __builtin_clz(biased)) - __builtin_ctz(REGISTRY_FIRST_SEGMENT);
+    return &registry->segments[segment][biased - ((unsigned)REGISTRY_FIRST_SEGMENT << segment)];
+}
 
-    // expand the semphores. 
-    if (threadPool.semLogicalLength == threadPool.semAllocatedLength)
+// make sure slot index exists, the caller holds the registry's lock.
+static bool RegistryReserve(Registry *registry, int index)
+{
+    unsigned biased = (unsigned)index + REGISTRY_FIRST_SEGMENT;
+    int segment = (31 - __builtin_clz(biased)) - __builtin_ctz(REGISTRY_FIRST_SEGMENT);
+    if (segment >= REGISTRY_SEGMENTS) return false;
+    if (registry->segments[segment] == NULL)
     {
-        threadPool.semaphores = realloc(threadPool.semaphores,
-                                        sizeof(Semaphore) * threadPool.semAllocatedLength * 2);
-        if (threadPool.semaphores == NULL) {
+        registry->segments[segment] = malloc(sizeof(void *) * ((size_t)REGISTRY_FIRST_SEGMENT << segment));
+        if (registry->segments[segment] == NULL)
+        {
             printf("errno is: %d\n", errno);
-            perror("realloc error\n");
+            perror("malloc error");
+            return false;
         }
-        threadPool.semAllocatedLength *= 2;
     }
+    return true;
+}
 
-    Semaphore sem = malloc(sizeof(struct SemaphoreImplementation));
-    // sem_init is not available in macOS, use sem_open instead it.
-    #ifdef __APPLE__
-    dispatch_semaphore_t *__semaphore__ = malloc(sizeof(dispatch_semaphore_t));
-    *__semaphore__ = dispatch_semaphore_create(initialValue);
-    if (*__semaphore__ == NULL) perror("dispatch_semaphore_create error");
-    #else
-    sem_t *__semaphore__ = sem_open(debugName, O_CREAT, 0600, initialValue);
-    if (__semaphore__ == SEM_FAILED) perror("sem_open error");
-    #endif
-    sem->__semaphore__ = __semaphore__;
-    sem->debugName = malloc(strlen(debugName) + 1);
-    strcpy(sem->debugName, debugName);
-
-    memcpy(&(threadPool.semaphores[threadPool.semLogicalLength]), &sem, sizeof(Semaphore));
-    threadPool.semLogicalLength ++;
-
-    int unlocked = pthread_mutex_unlock(&semaphoreNewLock);
-    if (unlocked != 0) perror("pthread_mutex_unlock error");
-
-    return sem;
+static void RegistryFree(Registry *registry)
+{
+    for (int i = 0; i < REGISTRY_SEGMENTS; i++)
+    {
+        free(registry->segments[i]);
+        registry->segments[i] = NULL;
+    }
 }
 
-const char *SemaphoreName(Semaphore s)
+static inline ThreadInfo *ThreadInfoAt(int index)
 {
-    return s->debugName;
+    return *RegistrySlot(&threadPool.threadInfos, index);
 }
 
-void SemaphoreWait(Semaphore s)
+static inline Semaphore SemaphoreAt(int index)
 {
-    #ifdef __APPLE__
-    int result = dispatch_semaphore_wait(*(s->__semaphore__), DISPATCH_TIME_FOREVER);
-    if (result != 0) perror("dispatch_semaphore_wait error");
-    #else
-    int result = sem_wait(s->__semaphore__);
-    if (result != 0) perror("sem_wait error");
-    #endif
+    return *RegistrySlot(&threadPool.semaphores, index);
 }
 
-void SemaphoreSignal(Semaphore s)
+// ---------------------------------------------------------------------------
+// tracing, enabled by InitThreadPackage(true).
+//
+// Every OS thread appends fixed-size events to its own ring buffer (single
+// writer, no locks, the oldest events are overwritten when it is full). Each
+// event also names the task that recorded it, so tasks sharing a worker
+// (pool or green threads) still get a track of their own. The buffers are
+// dumped in a compact binary format by TraceDump, which FreeThreadPackage
+// calls, and TraceConvertToChrome turns a dump into Chrome/Perfetto trace
+// JSON.
+//
+// binary format, all integers little-endian as written by the host:
+//   char magic[8] = "T107TRC2"
+//   uint32 nameCount, then per name:   uint32 kind, uint32 id, uint32 length, char name[length]
+//   uint32 bufferCount, then per buffer: uint32 length, char threadName[length],
+//                                        uint64 eventCount, TraceEvent events[eventCount]
+// ---------------------------------------------------------------------------
+
+// number of events each thread keeps, a power of two
+#define TRACE_BUFFER_EVENTS 8192
+#define TRACE_MAGIC "T107TRC2"
+
+enum {
+    TRACE_THREAD_START = 1, // object: task index
+    TRACE_THREAD_STOP = 2, // object: task index
+    TRACE_WAIT_BEGIN = 3, // object: semaphore traceId
+    TRACE_WAIT_END = 4, // object: semaphore traceId
+    TRACE_SIGNAL = 5 // object: semaphore traceId
+};
+
+enum {
+    TRACE_NAME_TASK = 1,
+    TRACE_NAME_SEMAPHORE = 2
+};
+
+typedef struct {
+    uint64_t timestamp; // CLOCK_MONOTONIC nanoseconds
+    uint32_t kind; // TRACE_*
+    uint32_t object;
+    uint32_t task; // 1 + index of the task that recorded it, 0 outside tasks
+    uint32_t reserved; // 0, keeps events a multiple of 8 bytes
+} TraceEvent;
+
+typedef struct TraceBuffer {
+    struct TraceBuffer *next; // link in traceBuffers
+    char threadName[32];
+    _Atomic uint64_t head; // number of events ever written
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+} TraceBuffer;
+
+typedef struct TraceName {
+    struct TraceName *next;
+    uint32_t kind; // TRACE_NAME_*
+    uint32_t id;
+    char name[];
+} TraceName;
+
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER; // guards the two lists below
+static TraceBuffer *traceBuffers; // every buffer ever attached, freed by FreeThreadPackage
+static TraceName *traceNames; // names of semaphores, kept after SemaphoreFree
+static atomic_uint nextTraceId;
+static __thread TraceBuffer *traceBuffer = NULL;
+
+// give the calling thread its buffer, named after the thread.
+static TraceBuffer *TraceAttach(const char *threadName)
 {
-    #ifdef __APPLE__
-    dispatch_semaphore_signal(*(s->__semaphore__));
-    #else
-    int result = sem_post(s->__semaphore__);
-    if (result != 0) perror("sem_post error");
-    #endif
+    TraceBuffer *buffer = malloc(sizeof(TraceBuffer));
+    if (buffer == NULL)
+    {
+        perror("malloc error");
+        return NULL;
+    }
+    snprintf(buffer->threadName, sizeof(buffer->threadName), "%s", threadName);
+    atomic_init(&buffer->head, 0);
+
+    pthread_mutex_lock(&traceLock);
+    buffer->next = traceBuffers;
+    traceBuffers = buffer;
+    pthread_mutex_unlock(&traceLock);
+
+    traceBuffer = buffer;
+    return buffer;
 }
 
-void SemaphoreFree(Semaphore s)
+// noinline: a green thread may call it before and after switching OS threads.
+static __attribute__((noinline)) void TraceRecord(uint32_t kind, uint32_t object)
 {
-    #ifdef __APPLE__
-    free(s->__semaphore__);
-    #else
-    int result = sem_close(s->__semaphore__);
-    if (result != 0) perror("sem_close error");
-    #endif
-    free(s->debugName);
+    TraceBuffer *buffer = traceBuffer;
+    if (buffer == NULL)
+    {
+        const char *name = ThreadName();
+        buffer = TraceAttach(name != NULL ? name : "main");
+        if (buffer == NULL) return;
+    }
+
+    uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    TraceEvent *event = &buffer->events[head & (TRACE_BUFFER_EVENTS - 1)];
+    event->timestamp = MonotonicNanos();
+    event->kind = kind;
+    event->object = object;
+    event->task = currentThread != NULL ? (uint32_t)currentThread->index + 1 : 0;
+    event->reserved = 0;
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
 }
 
-void AcquireLibraryLock(void)
+static void TraceAddName(uint32_t kind, uint32_t id, const char *name)
 {
-    int locked = pthread_mutex_lock(&mutexLock);
-    if (locked != 0) perror("pthread_mutex_lock error");
+    size_t length = strlen(name) + 1;
+    TraceName *entry = malloc(sizeof(TraceName) + length);
+    if (entry == NULL)
+    {
+        perror("malloc error");
+        return;
+    }
+    entry->kind = kind;
+    entry->id = id;
+    memcpy(entry->name, name, length);
+
+    pthread_mutex_lock(&traceLock);
+    entry->next = traceNames;
+    traceNames = entry;
+    pthread_mutex_unlock(&traceLock);
 }
 
-void ReleaseLibraryLock(void)
+static void TraceWriteString(FILE *out, const char *string)
 {
-    int unlocked = pthread_mutex_unlock(&mutexLock);
-    if (unlocked != 0) perror("pthread_mutex_unlock error");
+    uint32_t length = (uint32_t)strlen(string);
+    fwrite(&length, sizeof(length), 1, out);
+    fwrite(string, 1, length, out);
 }
 
-void ListAllThreads(void)
+bool TraceDump(const char *path)
 {
-    // confirm that only one thread can call this function every single time
-    int locked = pthread_mutex_lock(&threadNewLock);
-    if (locked != 0) perror("pthread_mutex_lock error");
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
+    {
+        perror("fopen error");
+        return false;
+    }
+    fwrite(TRACE_MAGIC, 1, 8, out);
 
+    // task names come from the registry, semaphore names from traceNames.
+    pthread_mutex_lock(&threadNewLock);
+    pthread_mutex_lock(&traceLock);
+    uint32_t nameCount = (uint32_t)threadPool.logicalLength;
+    for (TraceName *entry = traceNames; entry != NULL; entry = entry->next) nameCount++;
+    fwrite(&nameCount, sizeof(nameCount), 1, out);
     for (int i = 0; i < threadPool.logicalLength; i++)
     {
-        printf("Thread's debugName is: %s\n", threadPool.threadInfos[i].debugName);
+        uint32_t header[2] = { TRACE_NAME_TASK, (uint32_t)i };
+        fwrite(header, sizeof(header), 1, out);
+        TraceWriteString(out, ThreadInfoAt(i)->debugName);
+    }
+    for (TraceName *entry = traceNames; entry != NULL; entry = entry->next)
+    {
+        uint32_t header[2] = { entry->kind, entry->id };
+        fwrite(header, sizeof(header), 1, out);
+        TraceWriteString(out, entry->name);
     }
+    pthread_mutex_unlock(&threadNewLock);
 
-    int unlocked = pthread_mutex_unlock(&threadNewLock);
-    if (unlocked != 0) perror("pthread_mutex_unlock error");
+    uint32_t bufferCount = 0;
+    for (TraceBuffer *buffer = traceBuffers; buffer != NULL; buffer = buffer->next) bufferCount++;
+    fwrite(&bufferCount, sizeof(bufferCount), 1, out);
+    for (TraceBuffer *buffer = traceBuffers; buffer != NULL; buffer = buffer->next)
+    {
+        // threads may still be writing: take what was published, oldest first.
+        uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        uint64_t count = head < TRACE_BUFFER_EVENTS ? head : TRACE_BUFFER_EVENTS;
+        TraceWriteString(out, buffer->threadName);
+        fwrite(&count, sizeof(count), 1, out);
+        for (uint64_t i = head - count; i < head; i++)
+        {
+            fwrite(&buffer->events[i & (TRACE_BUFFER_EVENTS - 1)], sizeof(TraceEvent), 1, out);
+        }
+    }
+    pthread_mutex_unlock(&traceLock);
+
+    bool written = (ferror(out) == 0);
+    if (fclose(out) != 0) written = false;
+    if (!written) perror("TraceDump write error");
+    return written;
 }
 
-void ListAllSemaphores(void)
+static char *TraceReadString(FILE *in)
 {
-    // confirm that only one thread can call this function every single time
-    int locked = pthread_mutex_lock(&semaphoreNewLock);
-    if (locked != 0) perror("pthread_mutex_lock error");
+    uint32_t length;
+    if (fread(&length, sizeof(length), 1, in) != 1) return NULL;
+    char *string = malloc(length + 1);
+    if (string == NULL || fread(string, 1, length, in) != length)
+    {
+        free(string);
+        return NULL;
+    }
+    string[length] = '\0';
+    return string;
+}
 
-    for (int i = 0; i < threadPool.semLogicalLength; i++)
+// print a string as a JSON string literal.
+static void TraceWriteJsonString(FILE *out, const char *string)
+{
+    fputc('"', out);
+    for (const char *c = string; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\') fprintf(out, "\\%c", *c);
+        else if ((unsigned char)*c < 0x20) fprintf(out, "\\u%04x", *c);
+        else fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+static const char *TraceLookupName(char **names, uint32_t count, uint32_t id)
+{
+    return (id < count && names[id] != NULL) ? names[id] : "?";
+}
+
+bool TraceConvertToChrome(const char *tracePath, const char *jsonPath)
+{
+    FILE *in = fopen(tracePath, "rb");
+    if (in == NULL)
+    {
+        perror("fopen error");
+        return false;
+    }
+    char magic[8];
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "TraceConvertToChrome error: %s is not a thread_107 trace\n", tracePath);
+        fclose(in);
+        return false;
+    }
+    FILE *out = fopen(jsonPath, "w");
+    if (out == NULL)
+    {
+        perror("fopen error");
+        fclose(in);
+        return false;
+    }
+
+    // ids are dense, so the names can be looked up by index.
+    uint32_t nameCount = 0, taskCount = 0, semaphoreCount = 0;
+    bool ok = (fread(&nameCount, sizeof(nameCount), 1, in) == 1);
+    uint32_t *ids = calloc(nameCount + 1, sizeof(uint32_t) * 2);
+    char **names = calloc(nameCount + 1, sizeof(char *));
+    for (uint32_t i = 0; ok && i < nameCount; i++)
+    {
+        uint32_t header[2];
+        ok = (fread(header, sizeof(header), 1, in) == 1) && (names[i] = TraceReadString(in)) != NULL;
+        if (!ok) break;
+        ids[2 * i] = header[0];
+        ids[2 * i + 1] = header[1];
+        if (header[0] == TRACE_NAME_TASK && header[1] >= taskCount) taskCount = header[1] + 1;
+        if (header[0] == TRACE_NAME_SEMAPHORE && header[1] >= semaphoreCount) semaphoreCount = header[1] + 1;
+    }
+    char **tasks = calloc(taskCount + 1, sizeof(char *));
+    char **semaphores = calloc(semaphoreCount + 1, sizeof(char *));
+    for (uint32_t i = 0; ok && i < nameCount; i++)
+    {
+        if (ids[2 * i] == TRACE_NAME_TASK) tasks[ids[2 * i + 1]] = names[i];
+        else if (ids[2 * i] == TRACE_NAME_SEMAPHORE) semaphores[ids[2 * i + 1]] = names[i];
+    }
+
+    uint32_t bufferCount = 0;
+    ok = ok && (fread(&bufferCount, sizeof(bufferCount), 1, in) == 1);
+    // tids 1..bufferCount are OS threads, task i is tid bufferCount + 1 + i.
+    bool *taskNamed = calloc(taskCount + 1, sizeof(bool));
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (uint32_t tid = 1; ok && tid <= bufferCount; tid++)
     {
-        printf("There is a Semaphores named %s\n", threadPool.semaphores[i]->debugName);
+        char *threadName = TraceReadString(in);
+        uint64_t count;
+        if (threadName == NULL || fread(&count, sizeof(count), 1, in) != 1)
+        {
+            free(threadName);
+            ok = false;
+            break;
+        }
+        fprintf(out, "%s{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":",
+                first ? "" : ",\n", tid);
+        TraceWriteJsonString(out, threadName);
+        fprintf(out, "}}");
+        first = false;
+        free(threadName);
+
+        for (uint64_t i = 0; i < count; i++)
+        {
+            TraceEvent event;
+            if (fread(&event, sizeof(event), 1, in) != 1)
+            {
+                ok = false;
+                break;
+            }
+            const char *phase = "i";
+            const char *prefix = "signal ";
+            const char *name;
+            switch (event.kind)
+            {
+                case TRACE_THREAD_START: phase = "B"; prefix = ""; break;
+                case TRACE_THREAD_STOP: phase = "E"; prefix = ""; break;
+                case TRACE_WAIT_BEGIN: phase = "B"; prefix = "wait "; break;
+                case TRACE_WAIT_END: phase = "E"; prefix = "wait "; break;
+                default: break;
+            }
+            if (event.kind == TRACE_THREAD_START || event.kind == TRACE_THREAD_STOP)
+                name = TraceLookupName(tasks, taskCount, event.object);
+            else
+                name = TraceLookupName(semaphores, semaphoreCount, event.object);
+
+            // a task's events go on its own track, named the first time it shows up.
+            uint32_t track = tid;
+            if (event.task != 0 && event.task <= taskCount)
+            {
+                track = bufferCount + event.task;
+                if (!taskNamed[event.task - 1])
+                {
+                    taskNamed[event.task - 1] = true;
+                    fprintf(out, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"name\":\"thread_name\",\"args\":{\"name\":", track);
+                    TraceWriteJsonString(out, TraceLookupName(tasks, taskCount, event.task - 1));
+                    fprintf(out, "}}");
+                }
+            }
+
+            // chrome expects microseconds.
+            char label[256];
+            snprintf(label, sizeof(label), "%s%s", prefix, name);
+            fprintf(out, ",\n{\"ph\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,%s\"name\":",
+                    phase, track, event.timestamp / 1000.0, phase[0] == 'i' ? "\"s\":\"t\"," : "");
+            TraceWriteJsonString(out, label);
+            fprintf(out, "}");
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    for (uint32_t i = 0; i < nameCount; i++) free(names[i]);
+    free(names);
+    free(ids);
+    free(tasks);
+    free(taskNamed);
+    free(semaphores);
+    fclose(in);
+    if (fclose(out) != 0) ok = false;
+    if (!ok) fprintf(stderr, "TraceConvertToChrome error: %s is truncated\n", tracePath);
+    return ok;
+}
+
+// free every buffer and name, called once no thread records any more.
+static void TraceFreeAll(void)
+{
+    pthread_mutex_lock(&traceLock);
+    while (traceBuffers != NULL)
+    {
+        TraceBuffer *next = traceBuffers->next;
+        free(traceBuffers);
+        traceBuffers = next;
+    }
+    while (traceNames != NULL)
+    {
+        TraceName *next = traceNames->next;
+        free(traceNames);
+        traceNames = next;
+    }
+    pthread_mutex_unlock(&traceLock);
+    traceBuffer = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// asynchronous logging, enabled by UseAsyncLog.
+//
+// Every OS thread formats ThreadLog records into its own byte ring (single
+// writer, single reader, no locks). A flusher thread wakes every
+// LOG_FLUSH_INTERVAL_NS, or sooner when a ring fills up or LogFlush asks,
+// takes every record older than the oldest ThreadLog still being written,
+// sorts them by timestamp and writes them out with one fwrite each, so the
+// output is in timestamp order and only the flusher ever takes stdio's lock.
+//
+// record layout in a ring, never wrapping around:
+//   uint64 timestamp, uint32 length, uint32 unused, char text[length]
+// length LOG_PADDING marks the unused tail of the ring before a wrap.
+// Records are rounded up to a multiple of the 16-byte header, so a tail
+// too short for a record always still has room for the padding header.
+// ---------------------------------------------------------------------------
+
+#define LOG_BUFFER_BYTES (64 * 1024) // per thread, a power of two
+#define LOG_RECORD_MAX 1024 // longer messages are truncated
+#define LOG_FLUSH_INTERVAL_NS 5000000ull
+#define LOG_PADDING UINT32_MAX
+
+typedef struct {
+    uint64_t timestamp;
+    uint32_t length; // bytes of text, or LOG_PADDING
+    uint32_t unused;
+} LogRecordHeader;
+
+typedef struct LogBuffer {
+    struct LogBuffer *next; // link in logState.buffers
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head; // bytes ever written, advanced by the owner
+    _Atomic uint64_t pending; // timestamp of the record being written, 1 while taking it, else 0
+    uint64_t lastTimestamp; // timestamps of one thread are strictly increasing
+    atomic_ulong dropped; // records LOG_DROP threw away
+    atomic_bool retired; // the owner has exited, free it once drained
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t tail; // bytes ever consumed, advanced by the flusher
+    uint64_t taken; // where the current flush pass stops, flusher only
+    char data[LOG_BUFFER_BYTES];
+} LogBuffer;
+
+// one record picked for the current flush pass.
+typedef struct {
+    uint64_t timestamp;
+    const char *text;
+    uint32_t length;
+} LogEntry;
+
+static struct {
+    bool enabled;
+    LogOverflow overflow;
+    FILE *out;
+    pthread_t flusher;
+    pthread_mutex_t lock; // guards buffers
+    LogBuffer *buffers;
+    atomic_int events; // bumped to wake the flusher, which sleeps on it
+    atomic_int flushRequested; // LogFlush calls so far
+    atomic_int flushDone; // requests covered by a completed pass, LogFlush sleeps on it
+    atomic_int flushWaiters;
+    atomic_bool stopping;
+    LogEntry *entries; // scratch array of the flusher
+    size_t entriesCapacity;
+} logState;
+
+static __thread LogBuffer *logBuffer = NULL;
+
+static void LogWakeFlusher(void)
+{
+    atomic_fetch_add(&logState.events, 1);
+    FutexWake(&logState.events, 1);
+}
+
+static LogBuffer *LogAttach(void)
+{
+    LogBuffer *buffer = NULL;
+    if (posix_memalign((void **)&buffer, CACHE_LINE_SIZE, sizeof(LogBuffer)) != 0)
+    {
+        perror("posix_memalign error");
+        return NULL;
+    }
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->pending, 0);
+    buffer->lastTimestamp = 0;
+    atomic_init(&buffer->dropped, 0);
+    atomic_init(&buffer->retired, false);
+    atomic_init(&buffer->tail, 0);
+    buffer->taken = 0;
+
+    pthread_mutex_lock(&logState.lock);
+    buffer->next = logState.buffers;
+    logState.buffers = buffer;
+    pthread_mutex_unlock(&logState.lock);
+
+    logBuffer = buffer;
+    return buffer;
+}
+
+// the calling OS thread is about to exit, the flusher frees its buffer once drained.
+static void LogDetach(void)
+{
+    if (logBuffer == NULL) return;
+    atomic_store(&logBuffer->retired, true);
+    logBuffer = NULL;
+}
+
+static inline uint64_t LogRecordSize(uint32_t length)
+{
+    uint64_t align = sizeof(LogRecordHeader);
+    return (sizeof(LogRecordHeader) + length + align - 1) & ~(align - 1);
+}
+
+// room for a record of up to LOG_RECORD_MAX bytes at head, after padding
+// out the end of the ring if needed. false if the flusher is behind.
+static bool LogReserve(LogBuffer *buffer, uint64_t *head)
+{
+    uint64_t needed = LogRecordSize(LOG_RECORD_MAX);
+    uint64_t position = *head & (LOG_BUFFER_BYTES - 1);
+    uint64_t toEnd = LOG_BUFFER_BYTES - position;
+    if (toEnd < needed) needed += toEnd;
+    uint64_t tail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+    if (LOG_BUFFER_BYTES - (*head - tail) < needed) return false;
+    if (toEnd < LogRecordSize(LOG_RECORD_MAX))
+    {
+        LogRecordHeader *padding = (LogRecordHeader *)(buffer->data + position);
+        padding->length = LOG_PADDING;
+        *head += toEnd;
+    }
+    return true;
+}
+
+void ThreadLog(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (!logState.enabled)
+    {
+        vprintf(format, args);
+        va_end(args);
+        return;
+    }
+    LogBuffer *buffer = logBuffer != NULL ? logBuffer : LogAttach();
+    if (buffer == NULL)
+    {
+        va_end(args);
+        return;
+    }
+
+    // announce the record before taking its time, so the flusher holds
+    // back anything newer until it is committed.
+    atomic_store(&buffer->pending, 1);
+    uint64_t timestamp = MonotonicNanos();
+    if (timestamp <= buffer->lastTimestamp) timestamp = buffer->lastTimestamp + 1;
+    buffer->lastTimestamp = timestamp;
+    atomic_store(&buffer->pending, timestamp);
+
+    uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    while (!LogReserve(buffer, &head))
+    {
+        if (logState.overflow == LOG_DROP)
+        {
+            atomic_fetch_add_explicit(&buffer->dropped, 1, memory_order_relaxed);
+            atomic_store(&buffer->pending, 0);
+            va_end(args);
+            return;
+        }
+        // LOG_BLOCK: our pending timestamp is older than anything in the
+        // way, so the flusher can always drain this ring.
+        LogWakeFlusher();
+        sched_yield();
+    }
+
+    LogRecordHeader *header = (LogRecordHeader *)(buffer->data + (head & (LOG_BUFFER_BYTES - 1)));
+    int length = vsnprintf((char *)(header + 1), LOG_RECORD_MAX, format, args);
+    va_end(args);
+    if (length < 0) length = 0;
+    if (length >= LOG_RECORD_MAX) length = LOG_RECORD_MAX - 1;
+    header->timestamp = timestamp;
+    header->length = (uint32_t)length;
+    uint64_t used = head + LogRecordSize((uint32_t)length) - atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    atomic_store_explicit(&buffer->head, head + LogRecordSize((uint32_t)length), memory_order_release);
+    atomic_store(&buffer->pending, 0);
+
+    if (used > LOG_BUFFER_BYTES / 2) LogWakeFlusher();
+}
+
+static int LogEntryCompare(const void *a, const void *b)
+{
+    uint64_t x = ((const LogEntry *)a)->timestamp, y = ((const LogEntry *)b)->timestamp;
+    return x < y ? -1 : x > y;
+}
+
+static bool LogAddEntry(uint64_t timestamp, const char *text, uint32_t length, size_t *count)
+{
+    if (*count == logState.entriesCapacity)
+    {
+        size_t capacity = logState.entriesCapacity == 0 ? 1024 : logState.entriesCapacity * 2;
+        LogEntry *entries = realloc(logState.entries, sizeof(LogEntry) * capacity);
+        if (entries == NULL)
+        {
+            perror("realloc error");
+            return false;
+        }
+        logState.entries = entries;
+        logState.entriesCapacity = capacity;
+    }
+    logState.entries[(*count)++] = (LogEntry){ timestamp, text, length };
+    return true;
+}
+
+// write every record older than any ThreadLog in progress, in timestamp
+// order. Returns the cutoff: everything logged before it has been written.
+static uint64_t LogFlushPass(void)
+{
+    uint64_t cutoff = MonotonicNanos();
+    size_t count = 0;
+
+    pthread_mutex_lock(&logState.lock);
+    for (LogBuffer *buffer = logState.buffers; buffer != NULL; buffer = buffer->next)
+    {
+        uint64_t pending;
+        // 1 lasts for one clock read, which may come before our cutoff.
+        while ((pending = atomic_load(&buffer->pending)) == 1) sched_yield();
+        if (pending != 0 && pending < cutoff) cutoff = pending;
+    }
+
+    // each ring is in timestamp order, so what qualifies is a prefix of it.
+    for (LogBuffer *buffer = logState.buffers; buffer != NULL; buffer = buffer->next)
+    {
+        uint64_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+        while (tail < head)
+        {
+            LogRecordHeader *header = (LogRecordHeader *)(buffer->data + (tail & (LOG_BUFFER_BYTES - 1)));
+            if (header->length == LOG_PADDING)
+            {
+                tail += LOG_BUFFER_BYTES - (tail & (LOG_BUFFER_BYTES - 1));
+                continue;
+            }
+            if (header->timestamp >= cutoff) break;
+            if (!LogAddEntry(header->timestamp, (const char *)(header + 1), header->length, &count)) break;
+            tail += LogRecordSize(header->length);
+        }
+        buffer->taken = tail;
+    }
+
+    qsort(logState.entries, count, sizeof(LogEntry), LogEntryCompare);
+    for (size_t i = 0; i < count; i++) fwrite(logState.entries[i].text, 1, logState.entries[i].length, logState.out);
+
+    // only now hand the space back to the writers.
+    LogBuffer **link = &logState.buffers;
+    while (*link != NULL)
+    {
+        LogBuffer *buffer = *link;
+        atomic_store_explicit(&buffer->tail, buffer->taken, memory_order_release);
+        unsigned long dropped = atomic_exchange_explicit(&buffer->dropped, 0, memory_order_relaxed);
+        if (dropped > 0) fprintf(logState.out, "thread_107: %lu log records dropped\n", dropped);
+        if (atomic_load(&buffer->retired) && atomic_load(&buffer->head) == buffer->taken)
+        {
+            *link = buffer->next;
+            free(buffer);
+            continue;
+        }
+        link = &buffer->next;
+    }
+    pthread_mutex_unlock(&logState.lock);
+
+    fflush(logState.out);
+    return cutoff;
+}
+
+static void *LogFlusher(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        int events = atomic_load(&logState.events);
+        bool stopping = atomic_load(&logState.stopping);
+        int requested = atomic_load(&logState.flushRequested);
+        uint64_t requestedAt = MonotonicNanos();
+        if (LogFlushPass() >= requestedAt)
+        {
+            if (atomic_load(&logState.flushDone) < requested)
+            {
+                atomic_store(&logState.flushDone, requested);
+                if (atomic_load(&logState.flushWaiters) > 0) FutexWake(&logState.flushDone, INT32_MAX);
+            }
+        }
+        else if (!stopping)
+        {
+            // a ThreadLog older than the request is still being written.
+            sched_yield();
+            continue;
+        }
+        if (stopping) return NULL;
+        FutexWaitUntil(&logState.events, events, MonotonicNanos() + LOG_FLUSH_INTERVAL_NS);
+    }
+}
+
+void UseAsyncLog(const char *path, LogOverflow overflow)
+{
+    if (logState.enabled) return;
+    FILE *out = stdout;
+    if (path != NULL && (out = fopen(path, "w")) == NULL)
+    {
+        perror("fopen error");
+        return;
+    }
+    fflush(stdout);
+    logState.out = out;
+    logState.overflow = overflow;
+    logState.buffers = NULL;
+    atomic_init(&logState.events, 0);
+    atomic_init(&logState.flushRequested, 0);
+    atomic_init(&logState.flushDone, 0);
+    atomic_init(&logState.flushWaiters, 0);
+    atomic_init(&logState.stopping, false);
+    pthread_mutex_init(&logState.lock, NULL);
+    if (pthread_create(&logState.flusher, NULL, LogFlusher, NULL) != 0)
+    {
+        perror("pthread_create error");
+        if (out != stdout) fclose(out);
+        pthread_mutex_destroy(&logState.lock);
+        return;
+    }
+    logState.enabled = true;
+}
+
+void LogFlush(void)
+{
+    if (!logState.enabled)
+    {
+        fflush(stdout);
+        return;
+    }
+    int ticket = atomic_fetch_add(&logState.flushRequested, 1) + 1;
+    atomic_fetch_add(&logState.flushWaiters, 1);
+    LogWakeFlusher();
+    int done;
+    while ((done = atomic_load(&logState.flushDone)) < ticket) FutexWait(&logState.flushDone, done);
+    atomic_fetch_sub(&logState.flushWaiters, 1);
+}
+
+// write out what is left and stop the flusher, called once no task logs any more.
+static void LogShutdown(void)
+{
+    if (!logState.enabled) return;
+    atomic_store(&logState.stopping, true);
+    LogWakeFlusher();
+    pthread_join(logState.flusher, NULL);
+    while (logState.buffers != NULL)
+    {
+        LogBuffer *next = logState.buffers->next;
+        free(logState.buffers);
+        logState.buffers = next;
+    }
+    free(logState.entries);
+    logState.entries = NULL;
+    logState.entriesCapacity = 0;
+    if (logState.out != stdout) fclose(logState.out);
+    pthread_mutex_destroy(&logState.lock);
+    logState.enabled = false;
+    logBuffer = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// CPU topology and thread placement.
+//
+// The CPUs this process may run on are read once, together with their
+// socket, core and L2/L3 cache domains from sysfs, and sorted into two
+// orders: compact (hyperthreads of a core, then cores sharing a cache, then
+// the next socket) and scatter (one CPU per socket, then per core, before any
+// two threads share a core). A placed thread is pinned to one CPU, the least
+// loaded one in policy order, so runs are reproducible. Everything here runs
+// under threadNewLock. Outside Linux placements are recorded, not applied.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    int cpu; // OS CPU number
+    int package; // physical socket
+    int core; // core id, unique within its package
+    int l2; // lowest CPU sharing this CPU's L2 cache, names the cache domain
+    int l3; // same for the last-level cache
+} CpuTopology;
+
+static struct {
+    int nCpus; // 0 until TopologyLoad ran
+    CpuTopology *cpus; // in compact order
+    int *scatter; // indexes into cpus, in scatter order
+    int *load; // placed, not yet joined threads per entry of cpus
+} topology;
+
+static PlacementPolicy placementPolicy = PLACEMENT_NONE;
+
+#ifdef __linux__
+static int ReadSysfsInt(int cpu, const char *file, int fallback)
+{
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu, file);
+    FILE *in = fopen(path, "r");
+    if (in == NULL) return fallback;
+    int value;
+    if (fscanf(in, "%d", &value) != 1) value = fallback;
+    fclose(in);
+    return value;
+}
+
+// lowest CPU of the cache of the given level shared with cpu, cpu itself if unknown.
+static int ReadCacheDomain(int cpu, int level)
+{
+    for (int index = 0; ; index++)
+    {
+        char file[64];
+        snprintf(file, sizeof(file), "cache/index%d/level", index);
+        int found = ReadSysfsInt(cpu, file, -1);
+        if (found < 0) return cpu;
+        if (found != level) continue;
+
+        // shared_cpu_list is like "0-3,8-11": its first number is the lowest CPU.
+        snprintf(file, sizeof(file), "cache/index%d/shared_cpu_list", index);
+        return ReadSysfsInt(cpu, file, cpu);
+    }
+}
+#endif
+
+static int CompareCompact(const void *a, const void *b)
+{
+    const CpuTopology *x = a, *y = b;
+    if (x->package != y->package) return x->package - y->package;
+    if (x->l3 != y->l3) return x->l3 - y->l3;
+    if (x->l2 != y->l2) return x->l2 - y->l2;
+    if (x->core != y->core) return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+static void TopologyOrder(int n);
+
+static void TopologyLoad(void)
+{
+    if (topology.nCpus > 0) return;
+
+    int maxCpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+    if (maxCpus <= 0) maxCpus = 1;
+    topology.cpus = malloc(sizeof(CpuTopology) * maxCpus);
+    int n = 0;
+    #ifdef __linux__
+    // only the CPUs we are allowed on, which is what containers and taskset hand out.
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) perror("sched_getaffinity error");
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < maxCpus; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        CpuTopology *entry = &topology.cpus[n++];
+        entry->cpu = cpu;
+        entry->package = ReadSysfsInt(cpu, "topology/physical_package_id", 0);
+        entry->core = ReadSysfsInt(cpu, "topology/core_id", cpu);
+        entry->l2 = ReadCacheDomain(cpu, 2);
+        entry->l3 = ReadCacheDomain(cpu, 3);
+    }
+    #endif
+    if (n == 0)
+    {
+        // no topology information: every CPU is a core of its own.
+        for (; n < maxCpus; n++)
+        {
+            topology.cpus[n] = (CpuTopology){ .cpu = n, .package = 0, .core = n, .l2 = n, .l3 = 0 };
+        }
+    }
+    TopologyOrder(n);
+}
+
+// sort the n CPUs in topology.cpus into compact order and derive the scatter order.
+static void TopologyOrder(int n)
+{
+    qsort(topology.cpus, n, sizeof(CpuTopology), CompareCompact);
+
+    // scatter: by the CPU's rank among its core's hyperthreads, then by its
+    // core's rank within the package, then by package.
+    int *siblingRank = calloc(n, sizeof(int));
+    int *coreRank = calloc(n, sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < i; j++)
+        {
+            const CpuTopology *a = &topology.cpus[i], *b = &topology.cpus[j];
+            if (a->package != b->package) continue;
+            if (a->core == b->core) siblingRank[i]++;
+            else if (siblingRank[j] == 0) coreRank[i]++;
+        }
+        // all hyperthreads of a core share its rank.
+        for (int j = 0; j < i; j++)
+        {
+            const CpuTopology *a = &topology.cpus[i], *b = &topology.cpus[j];
+            if (a->package == b->package && a->core == b->core) coreRank[i] = coreRank[j];
+        }
+    }
+    topology.scatter = malloc(sizeof(int) * n);
+    int placed = 0;
+    for (int sibling = 0; placed < n; sibling++)
+    {
+        for (int core = 0; core < n; core++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                if (siblingRank[i] == sibling && coreRank[i] == core) topology.scatter[placed++] = i;
+            }
+        }
+    }
+    free(siblingRank);
+    free(coreRank);
+
+    topology.load = calloc(n, sizeof(int));
+    topology.nCpus = n;
+}
+
+static void TopologyFree(void)
+{
+    free(topology.cpus);
+    free(topology.scatter);
+    free(topology.load);
+    memset(&topology, 0, sizeof(topology));
+}
+
+static int TopologyIndexOf(int cpu)
+{
+    for (int i = 0; i < topology.nCpus; i++)
+    {
+        if (topology.cpus[i].cpu == cpu) return i;
+    }
+    return -1;
+}
+
+// least loaded entry in the given order, the earliest one on ties.
+static int TopologyPick(PlacementPolicy policy)
+{
+    int best = -1;
+    for (int k = 0; k < topology.nCpus; k++)
+    {
+        int i = policy == PLACEMENT_SCATTER ? topology.scatter[k] : k;
+        if (best < 0 || topology.load[i] < topology.load[best]) best = i;
+    }
+    return best;
+}
+
+static Placement *PlacementNew(const int *cpus, int nCpus)
+{
+    Placement *placement = malloc(sizeof(Placement) + sizeof(int) * nCpus);
+    if (placement == NULL) return NULL;
+    placement->nCpus = nCpus;
+    memcpy(placement->cpus, cpus, sizeof(int) * nCpus);
+    int index = TopologyIndexOf(cpus[0]);
+    if (index >= 0) topology.load[index]++;
+    return placement;
+}
+
+// drop a thread's placement once it has been joined.
+static void PlacementRelease(ThreadInfo *t_info)
+{
+    if (t_info->placement == NULL) return;
+    int index = TopologyIndexOf(t_info->placement->cpus[0]);
+    if (index >= 0 && topology.load[index] > 0) topology.load[index]--;
+    free(t_info->placement);
+    t_info->placement = NULL;
+}
+
+// pin an existing thread, or describe the pinning for pthread_create.
+static void PlacementApply(const Placement *placement, pthread_t *tid, pthread_attr_t *attr)
+{
+    #ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < placement->nCpus; i++)
+    {
+        if (placement->cpus[i] >= 0 && placement->cpus[i] < CPU_SETSIZE) CPU_SET(placement->cpus[i], &set);
+    }
+    int result = tid != NULL ? pthread_setaffinity_np(*tid, sizeof(set), &set)
+                             : pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+    if (result != 0) fprintf(stderr, "thread_107: cannot pin to CPU %d: %s\n", placement->cpus[0], strerror(result));
+    #endif
+}
+
+// replace a thread's placement, pinning it right away if it already runs on a thread of its own.
+static void PlacementSet(ThreadInfo *t_info, Placement *placement)
+{
+    if (placement == NULL) return;
+    PlacementRelease(t_info);
+    t_info->placement = placement;
+    if (t_info->joinable) PlacementApply(placement, &t_info->tid, NULL);
+}
+
+// the placement policy gives a thread one CPU when it is launched.
+static Placement *PlacementForPolicy(void)
+{
+    if (placementPolicy == PLACEMENT_NONE) return NULL;
+    TopologyLoad();
+    int cpu = topology.cpus[TopologyPick(placementPolicy)].cpu;
+    return PlacementNew(&cpu, 1);
+}
+
+static ThreadInfo *PlacementTarget(ThreadId thread)
+{
+    if (thread < 0 || thread >= threadPool.logicalLength) return NULL;
+    return ThreadInfoAt(thread);
+}
+
+void ThreadSetPriority(ThreadId thread, int priority)
+{
+    priority = PriorityClamp(priority);
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+    ThreadInfo *t_info = PlacementTarget(thread);
+    if (t_info != NULL) atomic_store(&t_info->priority, priority);
+    pthread_mutex_unlock(&threadNewLock);
+}
+
+void SetPlacementPolicy(PlacementPolicy policy)
+{
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+    placementPolicy = policy;
+    pthread_mutex_unlock(&threadNewLock);
+}
+
+void ThreadPlaceOn(ThreadId thread, const int *cpus, int nCpus)
+{
+    if (cpus == NULL || nCpus <= 0) return;
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+    ThreadInfo *t_info = PlacementTarget(thread);
+    if (t_info != NULL)
+    {
+        TopologyLoad();
+        PlacementSet(t_info, PlacementNew(cpus, nCpus));
+    }
+    pthread_mutex_unlock(&threadNewLock);
+}
+
+void ThreadPlaceNear(ThreadId thread, ThreadId other)
+{
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+    ThreadInfo *t_info = PlacementTarget(thread);
+    ThreadInfo *o_info = PlacementTarget(other);
+    if (t_info != NULL && o_info != NULL && t_info != o_info)
+    {
+        TopologyLoad();
+        // the other thread needs a CPU first, the compact one if no policy picks it.
+        if (o_info->placement == NULL)
+        {
+            PlacementPolicy policy = placementPolicy == PLACEMENT_NONE ? PLACEMENT_COMPACT : placementPolicy;
+            int cpu = topology.cpus[TopologyPick(policy)].cpu;
+            PlacementSet(o_info, PlacementNew(&cpu, 1));
+        }
+        int near = TopologyIndexOf(o_info->placement->cpus[0]);
+
+        // least loaded other CPU sharing its L2, else its L3, else its socket.
+        int best = -1;
+        if (near >= 0)
+        {
+            const CpuTopology *n = &topology.cpus[near];
+            for (int level = 0; level < 3 && best < 0; level++)
+            {
+                for (int i = 0; i < topology.nCpus; i++)
+                {
+                    const CpuTopology *c = &topology.cpus[i];
+                    bool shares = level == 0 ? c->l2 == n->l2 : level == 1 ? c->l3 == n->l3 : c->package == n->package;
+                    if (i == near || !shares) continue;
+                    if (best < 0 || topology.load[i] < topology.load[best]) best = i;
+                }
+            }
+        }
+        int cpu = best >= 0 ? topology.cpus[best].cpu : o_info->placement->cpus[0];
+        PlacementSet(t_info, PlacementNew(&cpu, 1));
+    }
+    pthread_mutex_unlock(&threadNewLock);
+}
+
+// ---------------------------------------------------------------------------
+// green threads, enabled by UseGreenThreads.
+//
+// Each task runs on a stack of its own (mmap'd, with a PROT_NONE guard page
+// below it) and is multiplexed onto a few worker OS threads. A green thread
+// that has to wait saves its callee-saved registers and switches back to its
+// worker's scheduler loop, which picks the next runnable green thread from a
+// shared FIFO. Whatever must only happen once the green thread's context is
+// saved (unlocking the semaphore it parks on, arming its timer, freeing its
+// stack) is left to the scheduler as an after-switch action.
+//
+// A green thread may resume on another worker, so code that runs after a
+// switch must not reuse thread-local addresses computed before it: it reads
+// them again through GreenSelf and the other noinline accessors.
+// ---------------------------------------------------------------------------
+
+#define GREEN_DEFAULT_STACK (64 * 1024)
+#define GREEN_STACK_BATCH 64 // stacks carved from one mapping
+#define GREEN_STACK_CACHE 1024 // finished stacks kept warm, the rest give their pages back
+
+#if defined(__x86_64__) || defined(__aarch64__)
+// saved stack pointer, the registers themselves live on the stack.
+typedef struct {
+    void *sp;
+} GreenContext;
+#else
+#include <ucontext.h>
+typedef struct {
+    ucontext_t context;
+} GreenContext;
+#endif
+
+typedef struct GreenWorker GreenWorker;
+
+struct GreenThread {
+    GreenContext context; // valid while the green thread is switched out
+    ThreadInfo *t_info;
+    char *stack; // lowest address of the mapping (the guard page), NULL until first run
+    GreenWorker *worker; // the worker running it, set on every resume
+    GreenThread *runNext; // link in greenPool's run queue
+    GreenThread *waitNext; // links in a semaphore's green wait list
+    GreenThread *waitPrev;
+    bool queued; // in a semaphore's wait list, guarded by the semaphore's stripe lock
+    bool parked; // switched out until GreenWake or its deadline, guarded by greenPool.lock
+    int timerSlot; // index in greenPool.timers, -1 without a deadline
+    uint64_t deadlineNs;
+    uint64_t timerOrder; // equal deadlines fire in the order they were armed
+};
+
+// what the scheduler does once a green thread has switched out.
+enum {
+    GREEN_AFTER_PARK, // mark it parked, arm its deadline, then release afterLock
+    GREEN_AFTER_EXIT // its task returned: recycle stack and descriptor
+};
+
+struct GreenWorker {
+    GreenContext context; // the scheduler loop, switched to by green threads
+    GreenThread *current;
+    int after; // GREEN_AFTER_*
+    Lock afterLock; // may be NULL
+    uint64_t afterDeadlineNs;
+};
+
+static struct {
+    int numWorkers; // 0 means green mode is off
+    size_t stackSize; // usable bytes per stack, a multiple of the page size
+    size_t pageSize;
+    pthread_t *workers;
+    pthread_mutex_t lock; // guards everything below and every GreenThread.parked
+    pthread_cond_t notEmpty;
+    GreenThread *head[THREAD_PRIORITY_MAX + 1]; // runnable green threads, a FIFO per priority
+    GreenThread *tail[THREAD_PRIORITY_MAX + 1];
+    unsigned runnable; // bit p is set while head[p] is not empty
+    GreenThread **timers; // min-heap of parked green threads by deadlineNs
+    int nTimers;
+    int timersCapacity;
+    uint64_t timersArmed; // source of GreenThread.timerOrder
+    int running; // workers running a green thread right now
+    int clockHolds; // RunAllThreads calls still queueing tasks, the simulation clock waits for them
+    bool virtualTime; // see UseVirtualTime
+    _Atomic uint64_t virtualNow; // the simulation clock, only moved forward by the workers
+    char **batches; // every stack mapping, unmapped by GreenShutdown
+    int nBatches;
+    int batchesCapacity;
+    void *freeStacks; // unused stacks, see GreenStackLink
+    int nFreeStacks; // of which the first GREEN_STACK_CACHE keep their pages
+    int guardBudget; // stacks that may still get a guard page
+    bool shuttingDown;
+} greenPool;
+
+static __thread GreenThread *currentGreen = NULL;
+
+// how often threads that are not green re-read the simulation clock.
+#define VIRTUAL_POLL_NS 1000000ull
+
+// the clock of ThreadSleep and timed waits: CLOCK_MONOTONIC, or the
+// simulation clock under UseVirtualTime.
+static inline uint64_t ClockNanos(void)
+{
+    if (greenPool.virtualTime) return atomic_load_explicit(&greenPool.virtualNow, memory_order_acquire);
+    return MonotonicNanos();
+}
+
+static void GreenEntry(void *arg);
+
+// the green thread running on this OS thread, NULL outside green mode. The
+// empty volatile asm keeps the compiler from treating it as a pure function
+// and reusing its result across a switch.
+static __attribute__((noinline)) GreenThread *GreenSelf(void)
+{
+    __asm__ __volatile__("");
+    return currentGreen;
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define GREEN_STRINGIFY2(x) #x
+#define GREEN_STRINGIFY(x) GREEN_STRINGIFY2(x)
+#define GREEN_SYMBOL(name) GREEN_STRINGIFY(__USER_LABEL_PREFIX__) #name
+
+// save the callee-saved registers on the current stack, store its pointer in
+// *saveSp, load loadSp and restore the registers saved there.
+void GreenContextSwap(void **saveSp, void *loadSp);
+// first instruction of a green thread: call entry(arg), both taken from the
+// callee-saved registers of the initial frame. entry never returns.
+void GreenContextStart(void);
+
+#if defined(__x86_64__)
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    GREEN_SYMBOL(GreenContextSwap) ":\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".p2align 4\n"
+    GREEN_SYMBOL(GreenContextStart) ":\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+);
+
+static void GreenContextInit(GreenContext *context, char *stackTop, void (*entry)(void *), void *arg)
+{
+    // [csr] r15 r14 r13 r12 rbx rbp [return address], as GreenContextSwap leaves it.
+    uint64_t *sp = (uint64_t *)((uintptr_t)stackTop & ~(uintptr_t)15);
+    *--sp = (uint64_t)(uintptr_t)GreenContextStart;
+    *--sp = 0; // rbp
+    *--sp = 0; // rbx
+    *--sp = (uint64_t)(uintptr_t)arg; // r12
+    *--sp = (uint64_t)(uintptr_t)entry; // r13
+    *--sp = 0; // r14
+    *--sp = 0; // r15
+    *--sp = 0x1F80ull | (0x037Full << 32); // default mxcsr and x87 control word
+    context->sp = sp;
+}
+#else
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    GREEN_SYMBOL(GreenContextSwap) ":\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".p2align 4\n"
+    GREEN_SYMBOL(GreenContextStart) ":\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+);
+
+static void GreenContextInit(GreenContext *context, char *stackTop, void (*entry)(void *), void *arg)
+{
+    // x19 .. x30 then d8 .. d15, as GreenContextSwap leaves them.
+    uint64_t *sp = (uint64_t *)(((uintptr_t)stackTop & ~(uintptr_t)15) - 160);
+    memset(sp, 0, 160);
+    sp[0] = (uint64_t)(uintptr_t)arg; // x19
+    sp[1] = (uint64_t)(uintptr_t)entry; // x20
+    sp[11] = (uint64_t)(uintptr_t)GreenContextStart; // x30
+    context->sp = sp;
+}
+#endif
+
+static inline void GreenSwitch(GreenContext *from, GreenContext *to)
+{
+    GreenContextSwap(&from->sp, to->sp);
+}
+#else
+// portable but slower: swapcontext also saves and restores the signal mask.
+static void GreenUcontextEntry(void)
+{
+    GreenEntry(GreenSelf());
+}
+
+static void GreenContextInit(GreenContext *context, char *stackTop, void (*entry)(void *), void *arg)
+{
+    size_t usable = greenPool.stackSize;
+    getcontext(&context->context);
+    context->context.uc_stack.ss_sp = stackTop - usable;
+    context->context.uc_stack.ss_size = usable;
+    context->context.uc_link = NULL;
+    makecontext(&context->context, GreenUcontextEntry, 0);
+}
+
+static inline void GreenSwitch(GreenContext *from, GreenContext *to)
+{
+    if (swapcontext(&from->context, &to->context) != 0) perror("swapcontext error");
+}
+#endif
+
+// every guard page splits a mapping in two, and the kernel limits the number
+// of mappings (vm.max_map_count, 65530 by default). Guard at most a quarter
+// of that many stacks; the rest share unguarded mappings.
+static int GreenGuardBudget(void)
+{
+    int budget = INT32_MAX;
+    #ifdef __linux__
+    FILE *in = fopen("/proc/sys/vm/max_map_count", "r");
+    if (in != NULL)
+    {
+        int maxMaps;
+        if (fscanf(in, "%d", &maxMaps) == 1) budget = maxMaps / 4;
+        fclose(in);
+    }
+    #endif
+    return budget;
+}
+
+// free-list link of an unused stack, in the top word where the first frame
+// goes anyway, so a parked stack costs no page beyond the ones it used.
+static inline void **GreenStackLink(char *stack)
+{
+    return (void **)(stack + greenPool.pageSize + greenPool.stackSize) - 1;
+}
+
+// map GREEN_STACK_BATCH more stacks onto the free list, under greenPool.lock.
+static bool GreenStackBatch(void)
+{
+    if (greenPool.nBatches == greenPool.batchesCapacity)
+    {
+        int capacity = greenPool.batchesCapacity == 0 ? 16 : greenPool.batchesCapacity * 2;
+        char **batches = realloc(greenPool.batches, sizeof(char *) * capacity);
+        if (batches == NULL)
+        {
+            perror("realloc error");
+            return false;
+        }
+        greenPool.batches = batches;
+        greenPool.batchesCapacity = capacity;
+    }
+
+    // each stack sits on top of its guard page: [guard][stack][guard][stack]...
+    size_t slot = greenPool.pageSize + greenPool.stackSize;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    #ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE; // only the pages a green thread touches are backed
+    #endif
+    #ifdef MAP_STACK
+    flags |= MAP_STACK;
+    #endif
+    char *batch = mmap(NULL, slot * GREEN_STACK_BATCH, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (batch == MAP_FAILED)
+    {
+        perror("mmap error");
+        return false;
+    }
+    greenPool.batches[greenPool.nBatches++] = batch;
+    #ifdef MADV_NOHUGEPAGE
+    // a transparent huge page would back 2 MiB of stacks as soon as one is touched.
+    madvise(batch, slot * GREEN_STACK_BATCH, MADV_NOHUGEPAGE);
+    #endif
+
+    bool guarded = greenPool.guardBudget >= GREEN_STACK_BATCH;
+    if (guarded) greenPool.guardBudget -= GREEN_STACK_BATCH;
+    else if (greenPool.guardBudget >= 0)
+    {
+        greenPool.guardBudget = -1;
+        fprintf(stderr, "thread_107: vm.max_map_count reached, further green stacks have no guard page\n");
+    }
+    for (int i = GREEN_STACK_BATCH - 1; i >= 0; i--)
+    {
+        char *stack = batch + slot * i;
+        if (guarded && mprotect(stack, greenPool.pageSize, PROT_NONE) != 0) perror("mprotect error");
+        *GreenStackLink(stack) = greenPool.freeStacks;
+        greenPool.freeStacks = stack;
+        greenPool.nFreeStacks++;
+    }
+    return true;
+}
+
+// the guard page of an unused stack, NULL if none can be mapped. Under greenPool.lock.
+static char *GreenStackAlloc(void)
+{
+    if (greenPool.freeStacks == NULL && !GreenStackBatch()) return NULL;
+    char *stack = greenPool.freeStacks;
+    greenPool.freeStacks = *GreenStackLink(stack);
+    greenPool.nFreeStacks--;
+    return stack;
+}
+
+// under greenPool.lock.
+static void GreenStackRelease(char *stack)
+{
+    // beyond the cache, hand the pages back but keep the addresses.
+    if (greenPool.nFreeStacks >= GREEN_STACK_CACHE)
+    {
+        #ifdef MADV_DONTNEED
+        if (madvise(stack + greenPool.pageSize, greenPool.stackSize, MADV_DONTNEED) != 0) perror("madvise error");
+        #endif
+    }
+    *GreenStackLink(stack) = greenPool.freeStacks;
+    greenPool.freeStacks = stack;
+    greenPool.nFreeStacks++;
+}
+
+// append to the run queue of its priority, under greenPool.lock.
+static void GreenPush(GreenThread *green)
+{
+    int level = ThreadEffectivePriority(green->t_info);
+    green->runNext = NULL;
+    if (greenPool.tail[level] == NULL) greenPool.head[level] = green;
+    else greenPool.tail[level]->runNext = green;
+    greenPool.tail[level] = green;
+    greenPool.runnable |= 1u << level;
+    pthread_cond_signal(&greenPool.notEmpty);
+}
+
+// the oldest runnable green thread of the highest priority, under greenPool.lock.
+static GreenThread *GreenPop(void)
+{
+    int level = 31 - __builtin_clz(greenPool.runnable);
+    GreenThread *green = greenPool.head[level];
+    greenPool.head[level] = green->runNext;
+    if (greenPool.head[level] == NULL)
+    {
+        greenPool.tail[level] = NULL;
+        greenPool.runnable &= ~(1u << level);
+    }
+    return green;
+}
+
+static inline bool GreenTimerBefore(GreenThread *a, GreenThread *b)
+{
+    return a->deadlineNs < b->deadlineNs || (a->deadlineNs == b->deadlineNs && a->timerOrder < b->timerOrder);
+}
+
+static void GreenTimerSwap(int i, int j)
+{
+    GreenThread *t = greenPool.timers[i];
+    greenPool.timers[i] = greenPool.timers[j];
+    greenPool.timers[j] = t;
+    greenPool.timers[i]->timerSlot = i;
+    greenPool.timers[j]->timerSlot = j;
+}
+
+// restore the heap order around slot i after its deadline changed or it was refilled.
+static void GreenTimerFix(int i)
+{
+    while (i > 0 && GreenTimerBefore(greenPool.timers[i], greenPool.timers[(i - 1) / 2]))
+    {
+        GreenTimerSwap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;)
+    {
+        int smallest = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < greenPool.nTimers; child++)
+        {
+            if (GreenTimerBefore(greenPool.timers[child], greenPool.timers[smallest])) smallest = child;
+        }
+        if (smallest == i) return;
+        GreenTimerSwap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void GreenTimerAdd(GreenThread *green)
+{
+    if (greenPool.nTimers == greenPool.timersCapacity)
+    {
+        int capacity = greenPool.timersCapacity == 0 ? 64 : greenPool.timersCapacity * 2;
+        GreenThread **timers = realloc(greenPool.timers, sizeof(GreenThread *) * capacity);
+        if (timers == NULL)
+        {
+            // without a timer the deadline is only noticed on the next wake-up.
+            perror("realloc error");
+            return;
+        }
+        greenPool.timers = timers;
+        greenPool.timersCapacity = capacity;
+    }
+    green->timerOrder = greenPool.timersArmed++;
+    green->timerSlot = greenPool.nTimers++;
+    greenPool.timers[green->timerSlot] = green;
+    GreenTimerFix(green->timerSlot);
+}
+
+static void GreenTimerRemove(GreenThread *green)
+{
+    int slot = green->timerSlot;
+    if (slot < 0) return;
+    green->timerSlot = -1;
+    if (--greenPool.nTimers == slot) return;
+    greenPool.timers[slot] = greenPool.timers[greenPool.nTimers];
+    greenPool.timers[slot]->timerSlot = slot;
+    GreenTimerFix(slot);
+}
+
+// make a parked green thread runnable, false if it was not parked (its
+// deadline beat us to it). Under greenPool.lock.
+static bool GreenWakeLocked(GreenThread *green)
+{
+    if (!green->parked) return false;
+    green->parked = false;
+    GreenTimerRemove(green);
+    GreenPush(green);
+    return true;
+}
+
+static bool GreenWake(GreenThread *green)
+{
+    pthread_mutex_lock(&greenPool.lock);
+    bool woken = GreenWakeLocked(green);
+    pthread_mutex_unlock(&greenPool.lock);
+    return woken;
+}
+
+// wake every green thread whose deadline has passed, under greenPool.lock.
+static void GreenFireTimers(void)
+{
+    if (greenPool.nTimers == 0) return;
+    uint64_t now = ClockNanos();
+    while (greenPool.nTimers > 0 && greenPool.timers[0]->deadlineNs <= now)
+    {
+        GreenWakeLocked(greenPool.timers[0]);
+    }
+}
+
+// switch out until GreenWake or deadlineNs (FUTEX_FOREVER: no deadline).
+// unlock, if any, is released once the context is saved, so whoever needs it
+// to find this green thread can not resume it too early.
+static __attribute__((noinline)) void GreenPark(GreenThread *green, Lock unlock, uint64_t deadlineNs)
+{
+    GreenWorker *worker = green->worker;
+    worker->after = GREEN_AFTER_PARK;
+    worker->afterLock = unlock;
+    worker->afterDeadlineNs = deadlineNs;
+    GreenSwitch(&green->context, &worker->context);
+}
+
+// bottom frame of every green thread.
+static void GreenEntry(void *arg)
+{
+    GreenThread *green = arg;
+    ThreadInfo *t_info = green->t_info;
+    if (traceFlag) TraceRecord(TRACE_THREAD_START, t_info->index);
+    t_info->func(t_info->args);
+    if (traceFlag) TraceRecord(TRACE_THREAD_STOP, t_info->index);
+    TokenCacheFlush(t_info);
+
+    // the worker recycles this stack, so never come back.
+    GreenWorker *worker = green->worker;
+    worker->after = GREEN_AFTER_EXIT;
+    GreenSwitch(&green->context, &worker->context);
+}
+
+// idle until something is runnable or the earliest deadline, under greenPool.lock.
+static void GreenIdleWait(void)
+{
+    // simulated deadlines pass when the clock jumps, not while we sleep.
+    if (greenPool.nTimers == 0 || greenPool.virtualTime)
+    {
+        pthread_cond_wait(&greenPool.notEmpty, &greenPool.lock);
+        return;
+    }
+    uint64_t deadlineNs = greenPool.timers[0]->deadlineNs;
+    #ifdef __APPLE__
+    uint64_t now = MonotonicNanos();
+    uint64_t remaining = deadlineNs > now ? deadlineNs - now : 0;
+    struct timespec timeout = { .tv_sec = (time_t)(remaining / 1000000000ull),
+                                .tv_nsec = (long)(remaining % 1000000000ull) };
+    pthread_cond_timedwait_relative_np(&greenPool.notEmpty, &greenPool.lock, &timeout);
+    #else
+    // notEmpty runs on CLOCK_MONOTONIC, see UseGreenThreads.
+    struct timespec deadline = { .tv_sec = (time_t)(deadlineNs / 1000000000ull),
+                                 .tv_nsec = (long)(deadlineNs % 1000000000ull) };
+    pthread_cond_timedwait(&greenPool.notEmpty, &greenPool.lock, &deadline);
+    #endif
+}
+
+// body of every green worker: resume runnable green threads until FreeThreadPackage.
+static void *GreenWorkerLoop(void *arg)
+{
+    GreenWorker worker = { .current = NULL };
+    if (traceFlag)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "green worker %d", (int)(intptr_t)arg);
+        TraceAttach(name);
+    }
+
+    pthread_mutex_lock(&greenPool.lock);
+    for (;;)
+    {
+        GreenFireTimers();
+        if (greenPool.runnable == 0)
+        {
+            // parked green threads with deadlines keep the workers alive.
+            if (greenPool.shuttingDown && greenPool.nTimers == 0) break;
+            if (greenPool.virtualTime && greenPool.running == 0 && greenPool.clockHolds == 0 && greenPool.nTimers > 0)
+            {
+                // every green thread is blocked: skip straight to the next deadline.
+                atomic_store_explicit(&greenPool.virtualNow, greenPool.timers[0]->deadlineNs, memory_order_release);
+                continue;
+            }
+            GreenIdleWait();
+            continue;
+        }
+        GreenThread *green = GreenPop();
+        if (green->stack == NULL)
+        {
+            green->stack = GreenStackAlloc();
+            if (green->stack == NULL)
+            {
+                // nothing we can run it on: drop the task like a failed pthread_create.
+                SlabRelease(green, sizeof(GreenThread));
+                WaitGroupDone(&threadsAlive);
+                continue;
+            }
+            GreenContextInit(&green->context, green->stack + greenPool.pageSize + greenPool.stackSize, GreenEntry, green);
+        }
+        greenPool.running++;
+        pthread_mutex_unlock(&greenPool.lock);
+
+        green->worker = &worker;
+        worker.current = green;
+        currentGreen = green;
+        currentThread = green->t_info;
+        GreenSwitch(&worker.context, &green->context);
+        currentThread = NULL;
+        currentGreen = NULL;
+        worker.current = NULL;
+
+        pthread_mutex_lock(&greenPool.lock);
+        greenPool.running--;
+        if (worker.after == GREEN_AFTER_EXIT)
+        {
+            GreenStackRelease(green->stack);
+            SlabRelease(green, sizeof(GreenThread));
+            pthread_mutex_unlock(&greenPool.lock);
+            WaitGroupDone(&threadsAlive);
+            pthread_mutex_lock(&greenPool.lock);
+            continue;
+        }
+        green->parked = true;
+        green->deadlineNs = worker.afterDeadlineNs;
+        if (worker.afterDeadlineNs != FUTEX_FOREVER) GreenTimerAdd(green);
+        if (worker.afterLock != NULL)
+        {
+            // a waker takes afterLock before greenPool.lock, so drop ours first.
+            pthread_mutex_unlock(&greenPool.lock);
+            LockRelease(worker.afterLock);
+            pthread_mutex_lock(&greenPool.lock);
+        }
+    }
+    pthread_mutex_unlock(&greenPool.lock);
+    return NULL;
+}
+
+void UseGreenThreads(int numWorkers, size_t stackSize)
+{
+    if (greenPool.numWorkers > 0 || workerPool.numWorkers > 0) return;
+    if (numWorkers <= 0) numWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (numWorkers <= 0) numWorkers = 1;
+
+    greenPool.pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    if (stackSize == 0) stackSize = GREEN_DEFAULT_STACK;
+    greenPool.stackSize = (stackSize + greenPool.pageSize - 1) / greenPool.pageSize * greenPool.pageSize;
+    memset(greenPool.head, 0, sizeof(greenPool.head));
+    memset(greenPool.tail, 0, sizeof(greenPool.tail));
+    greenPool.runnable = 0;
+    greenPool.timers = NULL;
+    greenPool.nTimers = 0;
+    greenPool.timersCapacity = 0;
+    greenPool.timersArmed = 0;
+    greenPool.running = 0;
+    greenPool.clockHolds = 0;
+    greenPool.batches = NULL;
+    greenPool.nBatches = 0;
+    greenPool.batchesCapacity = 0;
+    greenPool.freeStacks = NULL;
+    greenPool.nFreeStacks = 0;
+    greenPool.guardBudget = GreenGuardBudget();
+    greenPool.shuttingDown = false;
+    int inited = pthread_mutex_init(&greenPool.lock, NULL);
+    if (inited != 0) perror("pthread_mutex_init error");
+    pthread_condattr_t condattr;
+    pthread_condattr_init(&condattr);
+    #ifndef __APPLE__
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    #endif
+    inited = pthread_cond_init(&greenPool.notEmpty, &condattr);
+    if (inited != 0) perror("pthread_cond_init error");
+    pthread_condattr_destroy(&condattr);
+
+    // as with the worker pool, the placement policy pins the workers.
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+    greenPool.workers = malloc(sizeof(pthread_t) * numWorkers);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        Placement *placement = PlacementForPolicy();
+        if (placement != NULL) PlacementApply(placement, NULL, &attr);
+        if (pthread_create(&greenPool.workers[i], &attr, GreenWorkerLoop, (void *)(intptr_t)i) != 0) perror("pthread_create error");
+        pthread_attr_destroy(&attr);
+        free(placement);
+    }
+    greenPool.numWorkers = numWorkers;
+    pthread_mutex_unlock(&threadNewLock);
+}
+
+void UseVirtualTime(void)
+{
+    if (greenPool.numWorkers == 0)
+    {
+        fprintf(stderr, "thread_107: UseVirtualTime needs UseGreenThreads first\n");
+        return;
+    }
+    pthread_mutex_lock(&greenPool.lock);
+    atomic_store(&greenPool.virtualNow, 0);
+    greenPool.virtualTime = true;
+    pthread_mutex_unlock(&greenPool.lock);
+}
+
+// keep the simulation clock still while a batch of tasks is queued, so the
+// first ones can not run ahead in time of the rest.
+static void GreenHoldClock(bool hold)
+{
+    pthread_mutex_lock(&greenPool.lock);
+    if (hold) greenPool.clockHolds++;
+    else if (--greenPool.clockHolds == 0) pthread_cond_broadcast(&greenPool.notEmpty);
+    pthread_mutex_unlock(&greenPool.lock);
+}
+
+// queue a task as a new green thread, its stack is mapped when it first runs.
+static void GreenLaunch(ThreadInfo *t_info)
+{
+    GreenThread *green = SlabAlloc(sizeof(GreenThread));
+    if (green == NULL)
+    {
+        WaitGroupDone(&threadsAlive);
+        return;
+    }
+    memset(green, 0, sizeof(GreenThread));
+    green->t_info = t_info;
+    green->timerSlot = -1;
+
+    pthread_mutex_lock(&greenPool.lock);
+    GreenPush(green);
+    pthread_mutex_unlock(&greenPool.lock);
+}
+
+// stop the workers once every green thread has finished, from FreeThreadPackage.
+static void GreenShutdown(void)
+{
+    pthread_mutex_lock(&greenPool.lock);
+    greenPool.shuttingDown = true;
+    pthread_cond_broadcast(&greenPool.notEmpty);
+    pthread_mutex_unlock(&greenPool.lock);
+
+    for (int i = 0; i < greenPool.numWorkers; i++)
+    {
+        if (pthread_join(greenPool.workers[i], NULL) != 0) perror("pthread_join error");
+    }
+    free(greenPool.workers);
+    for (int i = 0; i < greenPool.nBatches; i++)
+    {
+        if (munmap(greenPool.batches[i], (greenPool.pageSize + greenPool.stackSize) * GREEN_STACK_BATCH) != 0)
+            perror("munmap error");
+    }
+    free(greenPool.batches);
+    free(greenPool.timers);
+    greenPool.virtualTime = false;
+    pthread_mutex_destroy(&greenPool.lock);
+    pthread_cond_destroy(&greenPool.notEmpty);
+    greenPool.numWorkers = 0;
+}
+
+// for thread safety, you can call InitThreadPackage function only once in one thread(normally it will be the main thread)
+void InitThreadPackage(bool flag)
+{
+    traceFlag = flag;
+    if (traceFlag) TraceAttach("main");
+    threadPool.logicalLength = 0;
+    memset(&threadPool.threadInfos, 0, sizeof(Registry));
+    threadPool.semLogicalLength = 0;
+    memset(&threadPool.semaphores, 0, sizeof(Registry));
+    threadPool.running = false;
+    workerPool.numWorkers = 0;
+    atomic_init(&threadsAlive.count, 0);
+    atomic_init(&threadsAlive.waiters, 0);
+
+    // init mutexLock
+    int inited = pthread_mutex_init(&mutexLock, NULL);
+    if (inited != 0) perror("pthread_mutex_init error");
+
+    // init threadNewLock
+    inited = pthread_mutex_init(&threadNewLock, NULL);
+    if (inited != 0) perror("pthread_mutex_init error");
+
+    // init semaphoreNewLock
+    inited = pthread_mutex_init(&semaphoreNewLock, NULL);
+    if (inited != 0) perror("pthread_mutex_init error");
+}
+
+// for thread safety, you can call FreeThreadPackage function only once in one thread(normally it will be the main thread)
+void FreeThreadPackage()
+{
+    // nothing below may be freed while a task is still running.
+    JoinAllThreads();
+    LogShutdown();
+
+    if (traceFlag)
+    {
+        const char *tracePath = getenv("THREAD_107_TRACE");
+        if (tracePath == NULL) tracePath = "thread_107.trace";
+        if (TraceDump(tracePath)) fprintf(stderr, "thread_107: trace written to %s\n", tracePath);
+    }
+
+    // let the workers drain the run queue and exit before their tasks are freed.
+    if (workerPool.numWorkers > 0)
+    {
+        pthread_mutex_lock(&workerPool.lock);
+        workerPool.shuttingDown = true;
+        pthread_cond_broadcast(&workerPool.notEmpty);
+        pthread_mutex_unlock(&workerPool.lock);
+
+        for (int i = 0; i < workerPool.numWorkers; i++)
+        {
+            if (pthread_join(workerPool.workers[i], NULL) != 0) perror("pthread_join error");
+        }
+        free(workerPool.workers);
+        pthread_mutex_destroy(&workerPool.lock);
+        pthread_cond_destroy(&workerPool.notEmpty);
+        workerPool.numWorkers = 0;
+    }
+    if (greenPool.numWorkers > 0) GreenShutdown();
+
+    // free ThreadInfos (with their debugName and args) that did not fit a slab.
+    for (int i = 0; i < threadPool.logicalLength; i++)
+    {
+        ThreadInfo *t_info = ThreadInfoAt(i);
+        free(t_info->placement);
+        if (t_info->parker != NULL) SemaphoreFree(t_info->parker);
+        if (SlabClass(t_info->allocSize) >= SLAB_CLASSES) free(t_info);
+    }
+    
+    // free the whole threadInfos
+    RegistryFree(&threadPool.threadInfos);
+    threadPool.logicalLength = 0;
+
+    // free all Semaphores, SemaphoreFree removes each one from the registry.
+    while (threadPool.semLogicalLength > 0)
+    {
+        SemaphoreFree(SemaphoreAt(threadPool.semLogicalLength - 1));
+    }
+
+    // free the whole semaphores
+    RegistryFree(&threadPool.semaphores);
+
+    // every slab object is dead now, release the arena in one shot.
+    ArenaReleaseAll();
+
+    // free trace buffers and names, all threads are done recording.
+    TraceFreeAll();
+    TopologyFree();
+    placementPolicy = PLACEMENT_NONE;
+
+    // free mutexLock
+    int destoryed = pthread_mutex_destroy(&mutexLock);
+    if (destoryed != 0) perror("pthread_mutex_destory error");
+
+    // free threadNewLock
+    destoryed = pthread_mutex_destroy(&threadNewLock);
+    if (destoryed != 0) perror("pthread_mutex_destory error");
+
+    // free semaphoreNewLock
+    destoryed = pthread_mutex_destroy(&semaphoreNewLock);
+    if (destoryed != 0) perror("pthread_mutex_destory error");
+}
+
+static void LaunchThread(ThreadInfo *t_info);
+
+// body of ThreadNew and ThreadNewPrioritized. The priority is in place before
+// the thread can be launched, even by a ThreadNew from a running thread.
+static ThreadId ThreadNewV(const char *debugName, int priority, void *(*func)(void *), int nArg, va_list ap)
+{
+    // confirm that only one thread can call this function every single time
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+
+    // expand the threadInfos, existing slots never move.
+    if (!RegistryReserve(&threadPool.threadInfos, threadPool.logicalLength))
+    {
+        pthread_mutex_unlock(&threadNewLock);
+        return -1;
+    }
+
+    // one slab object: the descriptor, then the args vector, then debugName.
+    size_t nameLength = strlen(debugName) + 1;
+    size_t allocSize = sizeof(ThreadInfo) + (nArg + 1) * sizeof(void *) + nameLength;
+    ThreadInfo *stored = SlabAlloc(allocSize);
+    if (stored == NULL)
+    {
+        pthread_mutex_unlock(&threadNewLock);
+        return -1;
+    }
+    void **args = (void **)(stored + 1);
+    char *name = (char *)(args + nArg + 1);
+    memcpy(name, debugName, nameLength);
+
+    stored->debugName = name;
+    stored->func = func;
+    stored->nArg = nArg;
+    stored->index = threadPool.logicalLength;
+    stored->allocSize = allocSize;
+    stored->args = args;
+    stored->joinable = false;
+    stored->placement = NULL;
+    memset(stored->tokens, 0, sizeof(stored->tokens));
+    stored->parker = NULL;
+    memset(stored->random, 0, sizeof(stored->random));
+    atomic_init(&stored->priority, PriorityClamp(priority));
+    atomic_init(&stored->boost, 0);
+    atomic_init(&stored->blockedOn, NULL);
+    atomic_init(&stored->heldLock.state, 0);
+    stored->heldLock.debugName = NULL;
+    stored->held = NULL;
+
+    // args[0] is the debugName, the variable arguments follow.
+    args[0] = name;
+    for (int i = 0; i < nArg; i++)
+    {
+        args[i + 1] = va_arg(ap, void *);
+    }
+
+    *RegistrySlot(&threadPool.threadInfos, threadPool.logicalLength) = stored;
+    threadPool.logicalLength ++;
+
+    // threads created by already running threads (e.g. store.c's Clerks) start immediately.
+    if (threadPool.running) LaunchThread(stored);
+
+    int unlocked = pthread_mutex_unlock(&threadNewLock);
+    if (unlocked != 0) perror("pthread_mutex_unlock error");
+    return stored->index;
+}
+
+ThreadId ThreadNew(const char *debugName, void *(*func)(void *), int nArg, ...)
+{
+    // variable-argument function, only accepts pointer(actually void *) as non-name arguments.
+    va_list ap;
+    va_start(ap, nArg);
+    ThreadId thread = ThreadNewV(debugName, 0, func, nArg, ap);
+    va_end(ap);
+    return thread;
+}
+
+ThreadId ThreadNewPrioritized(const char *debugName, int priority, void *(*func)(void *), int nArg, ...)
+{
+    va_list ap;
+    va_start(ap, nArg);
+    ThreadId thread = ThreadNewV(debugName, priority, func, nArg, ap);
+    va_end(ap);
+    return thread;
+}
+
+// sleep the OS thread until deadlineNs on CLOCK_MONOTONIC.
+static void ThreadSleepUntilReal(uint64_t deadlineNs)
+{
+    // an absolute deadline, so signals interrupting the sleep do not stretch it.
+    #ifdef __APPLE__
+    uint64_t now;
+    while ((now = MonotonicNanos()) < deadlineNs)
+    {
+        struct timespec sleeper = { .tv_sec = (time_t)((deadlineNs - now) / 1000000000ull),
+                                    .tv_nsec = (long)((deadlineNs - now) % 1000000000ull) };
+        if (nanosleep(&sleeper, NULL) != 0 && errno != EINTR) perror("sleep error");
+    }
+    #else
+    struct timespec deadline = { .tv_sec = (time_t)(deadlineNs / 1000000000ull),
+                                 .tv_nsec = (long)(deadlineNs % 1000000000ull) };
+    int result;
+    while ((result = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR);
+    if (result != 0) perror("clock_nanosleep error");
+    #endif
+}
+
+void ThreadSleep(int microSecs)
+{
+    if (microSecs <= 0) return;
+    ThreadSleepUntil(ClockNanos() + (uint64_t)microSecs * 1000);
+}
+
+void ThreadSleepUntil(uint64_t deadlineNs)
+{
+    // a green thread parks until its deadline, its worker keeps running others.
+    GreenThread *green = GreenSelf();
+    if (green != NULL)
+    {
+        while (ClockNanos() < deadlineNs) GreenPark(green, NULL, deadlineNs);
+        return;
+    }
+    // other threads just watch the simulation clock go by.
+    if (greenPool.virtualTime)
+    {
+        while (ClockNanos() < deadlineNs) ThreadSleepUntilReal(MonotonicNanos() + VIRTUAL_POLL_NS);
+        return;
+    }
+    ThreadSleepUntilReal(deadlineNs);
+}
+
+uint64_t ThreadNowNanos(void)
+{
+    return ClockNanos();
+}
+
+// lock-free and O(1): the descriptor is cached in thread-local storage at launch.
+const char *ThreadName(void)
+{
+    return currentThread == NULL ? NULL : currentThread->debugName;
+}
+
+// entry point of every thread created by RunAllThreads.
+static void *ThreadTrampoline(void *arg)
+{
+    currentThread = arg;
+    if (traceFlag) TraceRecord(TRACE_THREAD_START, currentThread->index);
+    void *result = currentThread->func(currentThread->args);
+    if (traceFlag) TraceRecord(TRACE_THREAD_STOP, currentThread->index);
+    TokenCacheFlush(currentThread);
+    SlabFlush();
+    LogDetach();
+    WaitGroupDone(&threadsAlive);
+    return result;
+}
+
+// body of every pool worker: run queued tasks until FreeThreadPackage.
+static void *WorkerLoop(void *arg)
+{
+    if (traceFlag)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "worker %d", (int)(intptr_t)arg);
+        TraceAttach(name);
+    }
+
+    for (;;)
+    {
+        pthread_mutex_lock(&workerPool.lock);
+        while (workerPool.head == NULL && !workerPool.shuttingDown)
+        {
+            pthread_cond_wait(&workerPool.notEmpty, &workerPool.lock);
+        }
+        ThreadInfo *t_info = workerPool.head;
+        if (t_info == NULL)
+        {
+            pthread_mutex_unlock(&workerPool.lock);
+            return NULL;
+        }
+        workerPool.head = t_info->next;
+        if (workerPool.head == NULL) workerPool.tail = NULL;
+        pthread_mutex_unlock(&workerPool.lock);
+
+        t_info->tid = pthread_self();
+        currentThread = t_info;
+        if (traceFlag) TraceRecord(TRACE_THREAD_START, t_info->index);
+        t_info->func(t_info->args);
+        if (traceFlag) TraceRecord(TRACE_THREAD_STOP, t_info->index);
+        TokenCacheFlush(t_info);
+        currentThread = NULL;
+        WaitGroupDone(&threadsAlive);
+    }
+}
+
+void UseWorkerPool(int numWorkers)
+{
+    if (workerPool.numWorkers > 0 || greenPool.numWorkers > 0) return;
+    if (numWorkers <= 0) numWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (numWorkers <= 0) numWorkers = 1;
+
+    workerPool.head = NULL;
+    workerPool.tail = NULL;
+    workerPool.shuttingDown = false;
+    int inited = pthread_mutex_init(&workerPool.lock, NULL);
+    if (inited != 0) perror("pthread_mutex_init error");
+    inited = pthread_cond_init(&workerPool.notEmpty, NULL);
+    if (inited != 0) perror("pthread_cond_init error");
+
+    // workers, not tasks, are what the placement policy pins in pool mode.
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+    workerPool.workers = malloc(sizeof(pthread_t) * numWorkers);
+    for (int i = 0; i < numWorkers; i++)
+    {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        Placement *placement = PlacementForPolicy();
+        if (placement != NULL) PlacementApply(placement, NULL, &attr);
+        if (pthread_create(&workerPool.workers[i], &attr, WorkerLoop, (void *)(intptr_t)i) != 0) perror("pthread_create error");
+        pthread_attr_destroy(&attr);
+        free(placement);
+    }
+    workerPool.numWorkers = numWorkers;
+    pthread_mutex_unlock(&threadNewLock);
+}
+
+// hand one task either to the worker pool or to a fresh OS thread, under threadNewLock.
+static void LaunchThread(ThreadInfo *t_info)
+{
+    WaitGroupAdd(&threadsAlive, 1);
+    if (greenPool.numWorkers > 0)
+    {
+        t_info->joinable = false;
+        GreenLaunch(t_info);
+        return;
+    }
+    if (workerPool.numWorkers > 0)
+    {
+        t_info->joinable = false;
+        pthread_mutex_lock(&workerPool.lock);
+        // behind every queued task of the same or a higher priority.
+        int priority = ThreadEffectivePriority(t_info);
+        if (workerPool.tail == NULL || ThreadEffectivePriority(workerPool.tail) >= priority)
+        {
+            t_info->next = NULL;
+            if (workerPool.tail == NULL) workerPool.head = t_info;
+            else workerPool.tail->next = t_info;
+            workerPool.tail = t_info;
+        }
+        else
+        {
+            ThreadInfo **link = &workerPool.head;
+            while (ThreadEffectivePriority(*link) >= priority) link = &(*link)->next;
+            t_info->next = *link;
+            *link = t_info;
+        }
+        pthread_cond_signal(&workerPool.notEmpty);
+        pthread_mutex_unlock(&workerPool.lock);
+        return;
+    }
+
+    // pinned from its first instruction, by ThreadPlace* or else by the policy.
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (t_info->placement == NULL) t_info->placement = PlacementForPolicy();
+    if (t_info->placement != NULL) PlacementApply(t_info->placement, NULL, &attr);
+
+    t_info->joinable = true;
+    if (pthread_create(&(t_info->tid), &attr, ThreadTrampoline, t_info) != 0)
+    {
+        perror("pthread_create error");
+        t_info->joinable = false;
+        WaitGroupDone(&threadsAlive);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// for thread safety, you can call RunAllThreads function only once in one thread(normally it will be the main thread)
+void RunAllThreads(void)
+{
+    // threads registered after this point are launched by ThreadNew itself.
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+    threadPool.running = true;
+    if (greenPool.numWorkers > 0) GreenHoldClock(true);
+    for (int i = 0; i < threadPool.logicalLength; i++)
+    {
+        LaunchThread(ThreadInfoAt(i));
+    }
+    if (greenPool.numWorkers > 0) GreenHoldClock(false);
+
+    int unlocked = pthread_mutex_unlock(&threadNewLock);
+    if (unlocked != 0) perror("pthread_mutex_unlock error");
+}
+
+void JoinAllThreads(void)
+{
+    // one wake-up once the last running task (including tasks it spawned) returns.
+    WaitGroupWait(&threadsAlive);
+
+    // every thread has finished, so each join only reaps its resources.
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+
+    for (int i = 0; i < threadPool.logicalLength; i++)
+    {
+        ThreadInfo *t_info = ThreadInfoAt(i);
+        if (!t_info->joinable) continue;
+        if (pthread_join(t_info->tid, NULL) != 0) perror("pthread_join error");
+        t_info->joinable = false;
+        PlacementRelease(t_info);
+    }
+
+    int unlocked = pthread_mutex_unlock(&threadNewLock);
+    if (unlocked != 0) perror("pthread_mutex_unlock error");
+}
+
+Semaphore SemaphoreNew(const char *debugName, int initialValue)
+{
+    // one allocation for the counter and its name, no kernel object is created.
+    size_t nameLength = strlen(debugName) + 1;
+    Semaphore sem = SlabAlloc(sizeof(struct SemaphoreImplementation) + nameLength);
+    if (sem == NULL) return NULL;
+    atomic_init(&sem->value, initialValue);
+    atomic_init(&sem->waiters, 0);
+    atomic_init(&sem->greenWaiters, 0);
+    sem->greenHead = NULL;
+    sem->greenTail = NULL;
+    atomic_init(&sem->asyncWaiters, 0);
+    sem->asyncHead = NULL;
+    sem->asyncTail = NULL;
+    sem->prioritized = false;
+    sem->inherits = false;
+    sem->priorityHead = NULL;
+    sem->priorityTail = NULL;
+    sem->owner = NULL;
+    sem->heldNext = NULL;
+    atomic_init(&sem->lent, 0);
+    memcpy(sem->debugName, debugName, nameLength);
+    sem->stats = statsFlag ? calloc(1, sizeof(SemaphoreCounters)) : NULL;
+    sem->traceId = atomic_fetch_add_explicit(&nextTraceId, 1, memory_order_relaxed);
+    if (traceFlag) TraceAddName(TRACE_NAME_SEMAPHORE, sem->traceId, debugName);
+
+    // confirm that only one thread can call this function every single time
+    int locked = pthread_mutex_lock(&semaphoreNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+
+    // expand the semphores, existing slots never move.
+    if (!RegistryReserve(&threadPool.semaphores, threadPool.semLogicalLength))
+    {
+        pthread_mutex_unlock(&semaphoreNewLock);
+        SlabRelease(sem, sizeof(struct SemaphoreImplementation) + nameLength);
+        return NULL;
+    }
+
+    sem->index = threadPool.semLogicalLength;
+    *RegistrySlot(&threadPool.semaphores, threadPool.semLogicalLength) = sem;
+    threadPool.semLogicalLength ++;
+
+    int unlocked = pthread_mutex_unlock(&semaphoreNewLock);
+    if (unlocked != 0) perror("pthread_mutex_unlock error");
+
+    return sem;
+}
+
+Semaphore SemaphoreNewPrioritized(const char *debugName, int initialValue)
+{
+    Semaphore sem = SemaphoreNew(debugName, initialValue);
+    if (sem == NULL) return NULL;
+    sem->prioritized = true;
+    sem->inherits = initialValue == 1;
+    return sem;
+}
+
+const char *SemaphoreName(Semaphore s)
+{
+    return s->debugName;
+}
+
+// take one unit if the count is positive, never blocks.
+static inline bool SemaphoreTryDecrement(Semaphore s)
+{
+    int value = atomic_load_explicit(&s->value, memory_order_relaxed);
+    while (value > 0)
+    {
+        if (atomic_compare_exchange_weak_explicit(&s->value, &value, value - 1,
+                                                  memory_order_acquire, memory_order_relaxed))
+            return true;
+    }
+    return false;
+}
+
+// account one wait that had to park for blockedNs.
+static void SemaphoreRecordBlocked(SemaphoreCounters *stats, uint64_t blockedNs)
+{
+    atomic_fetch_add_explicit(&stats->contendedWaits, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->totalBlockedNs, blockedNs, memory_order_relaxed);
+
+    unsigned long long max = atomic_load_explicit(&stats->maxBlockedNs, memory_order_relaxed);
+    while (blockedNs > max &&
+           !atomic_compare_exchange_weak_explicit(&stats->maxBlockedNs, &max, blockedNs,
+                                                  memory_order_relaxed, memory_order_relaxed));
+
+    // bucket i holds waits of [2^i, 2^(i+1)) ns, the last one everything longer.
+    int bucket = blockedNs == 0 ? 0 : 63 - __builtin_clzll(blockedNs);
+    if (bucket >= SEMAPHORE_HISTOGRAM_BUCKETS) bucket = SEMAPHORE_HISTOGRAM_BUCKETS - 1;
+    atomic_fetch_add_explicit(&stats->waitHistogram[bucket], 1, memory_order_relaxed);
+}
+
+// the semaphore's green wait list, under InternalLockFor(s).
+static void GreenWaitEnqueue(Semaphore s, GreenThread *green)
+{
+    green->waitNext = NULL;
+    green->waitPrev = s->greenTail;
+    if (s->greenTail == NULL) s->greenHead = green;
+    else s->greenTail->waitNext = green;
+    s->greenTail = green;
+    green->queued = true;
+    atomic_fetch_add(&s->greenWaiters, 1);
+}
+
+static void GreenWaitDequeue(Semaphore s, GreenThread *green)
+{
+    if (green->waitPrev == NULL) s->greenHead = green->waitNext;
+    else green->waitPrev->waitNext = green->waitNext;
+    if (green->waitNext == NULL) s->greenTail = green->waitPrev;
+    else green->waitNext->waitPrev = green->waitPrev;
+    green->queued = false;
+    atomic_fetch_sub_explicit(&s->greenWaiters, 1, memory_order_relaxed);
+}
+
+// the slow path of a green thread: park in the semaphore's list instead of
+// the kernel, so its worker runs other green threads meanwhile. *parked
+// tells whether it actually had to.
+static bool GreenSemaphoreWait(Semaphore s, GreenThread *green, uint64_t deadlineNs, bool *parked)
+{
+    Lock lock = InternalLockFor(s);
+    bool acquired;
+    LockAcquire(lock);
+    while (!(acquired = SemaphoreTryDecrement(s)))
+    {
+        if (deadlineNs != FUTEX_FOREVER && ClockNanos() >= deadlineNs) break;
+        // enqueue before re-checking so SemaphoreSignal can not miss us.
+        GreenWaitEnqueue(s, green);
+        if ((acquired = SemaphoreTryDecrement(s)))
+        {
+            GreenWaitDequeue(s, green);
+            break;
+        }
+        GreenPark(green, lock, deadlineNs); // the worker releases lock
+        *parked = true;
+        LockAcquire(lock);
+        if (green->queued) GreenWaitDequeue(s, green); // the deadline woke us
+    }
+    LockRelease(lock);
+    return acquired;
+}
+
+// hand one signal to the first parked green thread that is still waiting.
+static void GreenSemaphoreWake(Semaphore s)
+{
+    Lock lock = InternalLockFor(s);
+    LockAcquire(lock);
+    while (s->greenHead != NULL)
+    {
+        GreenThread *green = s->greenHead;
+        GreenWaitDequeue(s, green);
+        if (GreenWake(green)) break;
+    }
+    LockRelease(lock);
+}
+
+// a unit was taken on behalf of waiter: account for it and call it back.
+static void SemaphoreAsyncResume(Semaphore s, AsyncWaiter *waiter)
+{
+    if (s->stats != NULL)
+    {
+        atomic_fetch_add_explicit(&s->stats->acquisitions, 1, memory_order_relaxed);
+        SemaphoreRecordBlocked(s->stats, MonotonicNanos() - waiter->queuedAt);
+    }
+    void (*resume)(void *) = waiter->resume;
+    void *context = waiter->context;
+    SlabRelease(waiter, sizeof(AsyncWaiter));
+    resume(context);
+}
+
+// take a unit for the oldest pending SemaphoreWaitAsync, if there is one.
+static void SemaphoreWakeAsync(Semaphore s)
+{
+    Lock lock = InternalLockFor(s);
+    LockAcquire(lock);
+    AsyncWaiter *waiter = NULL;
+    if (s->asyncHead != NULL && SemaphoreTryDecrement(s))
+    {
+        waiter = s->asyncHead;
+        s->asyncHead = waiter->next;
+        if (s->asyncHead == NULL) s->asyncTail = NULL;
+        atomic_fetch_sub_explicit(&s->asyncWaiters, 1, memory_order_relaxed);
+    }
+    LockRelease(lock);
+    if (waiter != NULL) SemaphoreAsyncResume(s, waiter);
+}
+
+// the prioritized queue, under InternalLockFor(s): behind every waiter of the same or
+// a higher priority, so equal priorities stay FIFO.
+static void PriorityEnqueue(Semaphore s, PriorityWaiter *waiter)
+{
+    waiter->next = NULL;
+    if (s->priorityTail == NULL)
+    {
+        s->priorityHead = s->priorityTail = waiter;
+    }
+    else if (s->priorityTail->priority >= waiter->priority)
+    {
+        s->priorityTail->next = waiter;
+        s->priorityTail = waiter;
+    }
+    else
+    {
+        PriorityWaiter **link = &s->priorityHead;
+        while ((*link)->priority >= waiter->priority) link = &(*link)->next;
+        waiter->next = *link;
+        *link = waiter;
+    }
+    atomic_store(&s->lent, s->priorityHead->priority);
+}
+
+// unlink a queued waiter, under InternalLockFor(s).
+static void PriorityDequeue(Semaphore s, PriorityWaiter *waiter)
+{
+    PriorityWaiter *previous = NULL;
+    for (PriorityWaiter *w = s->priorityHead; w != NULL; previous = w, w = w->next)
+    {
+        if (w != waiter) continue;
+        if (previous == NULL) s->priorityHead = w->next;
+        else previous->next = w->next;
+        if (s->priorityTail == w) s->priorityTail = previous;
+        atomic_store(&s->lent, s->priorityHead != NULL ? s->priorityHead->priority : 0);
+        return;
+    }
+}
+
+// raise t_info to at least priority, false if it already was.
+static bool PriorityBoost(ThreadInfo *t_info, int priority)
+{
+    if (ThreadEffectivePriority(t_info) >= priority) return false;
+    int boost = atomic_load_explicit(&t_info->boost, memory_order_relaxed);
+    while (boost < priority &&
+           !atomic_compare_exchange_weak_explicit(&t_info->boost, &boost, priority,
+                                                  memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+// make t_info the holder of inheriting s, under InternalLockFor(s).
+static void PriorityTakeOwnership(Semaphore s, ThreadInfo *t_info)
+{
+    s->owner = t_info;
+    if (t_info == NULL) return;
+    LockAcquire(&t_info->heldLock);
+    s->heldNext = t_info->held;
+    t_info->held = s;
+    LockRelease(&t_info->heldLock);
+}
+
+// s has no holder any more, under InternalLockFor(s). Returns the old one.
+static ThreadInfo *PriorityDropOwnership(Semaphore s)
+{
+    ThreadInfo *owner = s->owner;
+    s->owner = NULL;
+    if (owner == NULL) return NULL;
+    LockAcquire(&owner->heldLock);
+    Semaphore *link = &owner->held;
+    while (*link != NULL && *link != s) link = &(*link)->heldNext;
+    if (*link != NULL) *link = s->heldNext;
+    s->heldNext = NULL;
+    LockRelease(&owner->heldLock);
+    return owner;
+}
+
+// after t_info let go of an inheriting semaphore: keep only the boost still
+// owed to waiters on the ones it holds. A PriorityBoost racing with us
+// changes boost, so the compare-exchange fails and we look again.
+static void PriorityRecompute(ThreadInfo *t_info)
+{
+    int seen = atomic_load(&t_info->boost);
+    for (;;)
+    {
+        int owed = 0;
+        LockAcquire(&t_info->heldLock);
+        for (Semaphore h = t_info->held; h != NULL; h = h->heldNext)
+        {
+            int lent = atomic_load(&h->lent);
+            if (lent > owed) owed = lent;
+        }
+        LockRelease(&t_info->heldLock);
+        if (owed == seen || atomic_compare_exchange_strong(&t_info->boost, &seen, owed)) return;
+    }
+}
+
+// lend priority to the holder of s, and on to whoever holds what that holder
+// waits for. Each hop takes one semaphore's lock at a time, never two.
+static void PriorityInherit(Semaphore s, int priority)
+{
+    ThreadInfo *waiting = NULL; // holder from the previous hop, queued on s
+    for (int depth = 0; depth < PRIORITY_CHAIN_DEPTH; depth++)
+    {
+        Lock lock = InternalLockFor(s);
+        LockAcquire(lock);
+        if (waiting != NULL)
+        {
+            // move it up its queue, unless it got its unit meanwhile.
+            PriorityWaiter *w = s->priorityHead;
+            while (w != NULL && w->t_info != waiting) w = w->next;
+            if (w == NULL || w->priority >= priority)
+            {
+                LockRelease(lock);
+                return;
+            }
+            PriorityDequeue(s, w);
+            w->priority = priority;
+            PriorityEnqueue(s, w);
+        }
+        ThreadInfo *owner = s->inherits ? s->owner : NULL;
+        Semaphore next = owner != NULL && PriorityBoost(owner, priority) ? atomic_load(&owner->blockedOn) : NULL;
+        LockRelease(lock);
+        if (next == NULL) return;
+        s = next;
+        waiting = owner;
+    }
+}
+
+// block until PriorityWaiterGrant or deadlineNs, false on timeout.
+static bool PriorityWaiterPark(PriorityWaiter *waiter, uint64_t deadlineNs)
+{
+    // tasks (green ones included) block the way semaphores do.
+    if (waiter->parker != NULL) return SemaphoreWaitInternal(waiter->parker, deadlineNs);
+    // under UseVirtualTime the deadline is simulated, so wake up to check it.
+    bool polling = greenPool.virtualTime && deadlineNs != FUTEX_FOREVER;
+    while (atomic_load_explicit(&waiter->state, memory_order_acquire) != QUEUE_GRANTED)
+    {
+        if (!FutexWaitUntil(&waiter->state, QUEUE_WAITING, polling ? MonotonicNanos() + VIRTUAL_POLL_NS : deadlineNs) &&
+            (!polling || ClockNanos() >= deadlineNs))
+            return atomic_load_explicit(&waiter->state, memory_order_acquire) == QUEUE_GRANTED;
+    }
+    return true;
+}
+
+static void PriorityWaiterGrant(PriorityWaiter *waiter)
+{
+    // the waiter returns once it sees the grant, read parker first.
+    Semaphore parker = waiter->parker;
+    if (parker != NULL)
+    {
+        SemaphoreSignal(parker);
+        return;
+    }
+    atomic_store_explicit(&waiter->state, QUEUE_GRANTED, memory_order_release);
+    FutexWake(&waiter->state, 1);
+}
+
+// every wait on a prioritized semaphore: a free unit is taken only while
+// nobody is queued, SemaphoreSignal hands the others out in priority order.
+static bool PrioritySemaphoreWait(Semaphore s, uint64_t deadlineNs, SemaphoreCounters *stats)
+{
+    ThreadInfo *t_info = currentThread;
+    Lock lock = InternalLockFor(s);
+    LockAcquire(lock);
+    if (SemaphoreTryDecrement(s))
+    {
+        if (s->inherits) PriorityTakeOwnership(s, t_info);
+        LockRelease(lock);
+        return true;
+    }
+    if (deadlineNs != FUTEX_FOREVER && ClockNanos() >= deadlineNs)
+    {
+        LockRelease(lock);
+        return false;
+    }
+
+    PriorityWaiter waiter;
+    waiter.t_info = t_info;
+    waiter.priority = ThreadEffectivePriority(t_info);
+    waiter.granted = false;
+    atomic_init(&waiter.state, QUEUE_WAITING);
+    waiter.parker = TaskParker();
+    PriorityEnqueue(s, &waiter);
+    if (t_info != NULL) atomic_store(&t_info->blockedOn, s);
+    LockRelease(lock);
+    if (s->inherits && waiter.priority > 0) PriorityInherit(s, waiter.priority);
+
+    uint64_t parkedAt = stats != NULL ? MonotonicNanos() : 0;
+    bool acquired = PriorityWaiterPark(&waiter, deadlineNs);
+    if (!acquired)
+    {
+        // timed out, but a signal may have picked us just before.
+        LockAcquire(lock);
+        acquired = waiter.granted;
+        if (!acquired) PriorityDequeue(s, &waiter);
+        LockRelease(lock);
+        if (acquired) PriorityWaiterPark(&waiter, FUTEX_FOREVER); // collect the grant
+    }
+    // not currentThread: a green thread may have moved to another worker.
+    if (waiter.t_info != NULL) atomic_store(&waiter.t_info->blockedOn, NULL);
+    if (stats != NULL) SemaphoreRecordBlocked(stats, MonotonicNanos() - parkedAt);
+    return acquired;
+}
+
+static bool PrioritySemaphoreTryWait(Semaphore s)
+{
+    Lock lock = InternalLockFor(s);
+    LockAcquire(lock);
+    bool acquired = SemaphoreTryDecrement(s);
+    if (acquired && s->inherits) PriorityTakeOwnership(s, currentThread);
+    LockRelease(lock);
+    return acquired;
+}
+
+// hand the unit straight to the first queued waiter, else count it.
+static void PrioritySemaphoreSignal(Semaphore s)
+{
+    Lock lock = InternalLockFor(s);
+    LockAcquire(lock);
+    // what the holder inherited through s ends with its hold.
+    ThreadInfo *owner = s->inherits ? PriorityDropOwnership(s) : NULL;
+    PriorityWaiter *waiter = s->priorityHead;
+    if (waiter != NULL)
+    {
+        s->priorityHead = waiter->next;
+        if (s->priorityHead == NULL) s->priorityTail = NULL;
+        atomic_store(&s->lent, s->priorityHead != NULL ? s->priorityHead->priority : 0);
+        waiter->granted = true;
+        if (s->inherits && waiter->t_info != NULL)
+        {
+            // the new holder runs on behalf of everyone still queued behind it.
+            PriorityTakeOwnership(s, waiter->t_info);
+            if (s->priorityHead != NULL) PriorityBoost(waiter->t_info, s->priorityHead->priority);
+        }
+    }
+    else
+    {
+        atomic_fetch_add(&s->value, 1);
+    }
+    LockRelease(lock);
+    if (owner != NULL && atomic_load_explicit(&owner->boost, memory_order_relaxed) != 0) PriorityRecompute(owner);
+    if (waiter != NULL) PriorityWaiterGrant(waiter);
+    else if (atomic_load(&s->asyncWaiters) > 0) SemaphoreWakeAsync(s);
+}
+
+// shared body of every blocking wait, false if deadlineNs passed first.
+static bool SemaphoreWaitInternal(Semaphore s, uint64_t deadlineNs)
+{
+    SemaphoreCounters *stats = s->stats;
+    if (traceFlag) TraceRecord(TRACE_WAIT_BEGIN, s->traceId);
+
+    if (s->prioritized)
+    {
+        // no spinning and no barging: units go to the queue in priority order.
+        bool acquired = PrioritySemaphoreWait(s, deadlineNs, stats);
+        if (acquired && stats != NULL) atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+        if (traceFlag) TraceRecord(TRACE_WAIT_END, s->traceId);
+        return acquired;
+    }
+
+    // fast path: spin a little, most waits are satisfied without a syscall.
+    // A green thread does not spin, that would only hold up its worker.
+    GreenThread *green = GreenSelf();
+    int spinLimit = green == NULL ? SEMAPHORE_SPIN_LIMIT : 1;
+    bool acquired = false;
+    for (int spin = 0; spin < spinLimit && !acquired; spin++)
+    {
+        if (!(acquired = SemaphoreTryDecrement(s))) CpuRelax();
+    }
+
+    if (!acquired && green != NULL)
+    {
+        // only a wait that really parked counts as contended.
+        uint64_t parkedAt = stats != NULL ? MonotonicNanos() : 0;
+        bool parked = false;
+        acquired = GreenSemaphoreWait(s, green, deadlineNs, &parked);
+        if (stats != NULL && parked) SemaphoreRecordBlocked(stats, MonotonicNanos() - parkedAt);
+    }
+    else if (!acquired)
+    {
+        // slow path: announce ourselves before re-checking so SemaphoreSignal can
+        // not miss us, then park until the count moves away from zero.
+        uint64_t parkedAt = stats != NULL ? MonotonicNanos() : 0;
+        atomic_fetch_add(&s->waiters, 1);
+        // under UseVirtualTime the deadline is simulated, so wake up to check it.
+        bool polling = greenPool.virtualTime && deadlineNs != FUTEX_FOREVER;
+        while (!(acquired = SemaphoreTryDecrement(s)))
+        {
+            if (!FutexWaitUntil(&s->value, 0, polling ? MonotonicNanos() + VIRTUAL_POLL_NS : deadlineNs) &&
+                (!polling || ClockNanos() >= deadlineNs))
+            {
+                // timed out, but a signal may have raced with the timeout.
+                acquired = SemaphoreTryDecrement(s);
+                break;
+            }
+        }
+        atomic_fetch_sub_explicit(&s->waiters, 1, memory_order_relaxed);
+        if (stats != NULL) SemaphoreRecordBlocked(stats, MonotonicNanos() - parkedAt);
+    }
+
+    if (acquired && stats != NULL) atomic_fetch_add_explicit(&stats->acquisitions, 1, memory_order_relaxed);
+    if (traceFlag) TraceRecord(TRACE_WAIT_END, s->traceId);
+    return acquired;
+}
+
+void SemaphoreWait(Semaphore s)
+{
+    SemaphoreWaitInternal(s, FUTEX_FOREVER);
+}
+
+bool SemaphoreTryWait(Semaphore s)
+{
+    if (s->prioritized ? !PrioritySemaphoreTryWait(s) : !SemaphoreTryDecrement(s)) return false;
+    if (s->stats != NULL) atomic_fetch_add_explicit(&s->stats->acquisitions, 1, memory_order_relaxed);
+    return true;
+}
+
+bool SemaphoreWaitUntil(Semaphore s, uint64_t deadlineNs)
+{
+    if (SemaphoreTryWait(s)) return true;
+    if (ClockNanos() >= deadlineNs) return false;
+    return SemaphoreWaitInternal(s, deadlineNs);
+}
+
+bool SemaphoreWaitFor(Semaphore s, uint64_t timeoutNs)
+{
+    uint64_t now = ClockNanos();
+    uint64_t deadline = timeoutNs > FUTEX_FOREVER - now ? FUTEX_FOREVER : now + timeoutNs;
+    return SemaphoreWaitUntil(s, deadline);
+}
+
+void SemaphoreSignal(Semaphore s)
+{
+    if (traceFlag) TraceRecord(TRACE_SIGNAL, s->traceId);
+    if (s->prioritized)
+    {
+        PrioritySemaphoreSignal(s);
+        return;
+    }
+    atomic_fetch_add(&s->value, 1);
+    // only enter the kernel when somebody is actually parked.
+    if (atomic_load(&s->waiters) > 0) FutexWake(&s->value, 1);
+    if (atomic_load(&s->greenWaiters) > 0) GreenSemaphoreWake(s);
+    if (atomic_load(&s->asyncWaiters) > 0) SemaphoreWakeAsync(s);
+}
+
+bool SemaphoreWaitAsync(Semaphore s, void (*resume)(void *), void *context)
+{
+    if (SemaphoreTryWait(s)) return true;
+
+    AsyncWaiter *waiter = SlabAlloc(sizeof(AsyncWaiter));
+    if (waiter == NULL)
+    {
+        // nowhere to queue it: block instead, the caller still gets its unit.
+        SemaphoreWait(s);
+        return true;
+    }
+    waiter->next = NULL;
+    waiter->resume = resume;
+    waiter->context = context;
+    waiter->queuedAt = s->stats != NULL ? MonotonicNanos() : 0;
+
+    Lock lock = InternalLockFor(s);
+    LockAcquire(lock);
+    if (s->asyncTail == NULL) s->asyncHead = waiter;
+    else s->asyncTail->next = waiter;
+    s->asyncTail = waiter;
+    // announce the waiter before re-checking so SemaphoreSignal can not miss it.
+    atomic_fetch_add(&s->asyncWaiters, 1);
+    bool acquired = false;
+    while (s->asyncHead != NULL && SemaphoreTryDecrement(s))
+    {
+        // hand units to the queue in order, ours may not be first.
+        AsyncWaiter *first = s->asyncHead;
+        s->asyncHead = first->next;
+        if (s->asyncHead == NULL) s->asyncTail = NULL;
+        atomic_fetch_sub_explicit(&s->asyncWaiters, 1, memory_order_relaxed);
+        if (first == waiter)
+        {
+            acquired = true;
+            break;
+        }
+        LockRelease(lock);
+        SemaphoreAsyncResume(s, first);
+        LockAcquire(lock);
+    }
+    LockRelease(lock);
+    if (acquired)
+    {
+        if (s->stats != NULL) atomic_fetch_add_explicit(&s->stats->acquisitions, 1, memory_order_relaxed);
+        SlabRelease(waiter, sizeof(AsyncWaiter));
+    }
+    return acquired;
+}
+
+// Not an atomic acquire: semaphores are taken one at a time in address
+// order, the one global order every caller agrees on, and on the first one
+// that is not free everything taken so far is given back before blocking on
+// just that one. Nobody blocks while holding part of a set, so there is no
+// deadlock and no shared lock. The price is that every give-back is a real
+// SemaphoreSignal, which may wake a waiter for nothing, and under heavy
+// contention on overlapping sets callers can keep backing off (livelock).
+void SemaphoreWaitAll(Semaphore *set, int n)
+{
+    Semaphore local[8];
+    Semaphore *order = local;
+    if (n > (int)(sizeof(local) / sizeof(local[0])))
+    {
+        order = malloc(sizeof(Semaphore) * n);
+        if (order == NULL)
+        {
+            // waiting in the caller's order instead could deadlock against
+            // a caller passing the same set in another order.
+            perror("malloc error");
+            abort();
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int j = i;
+        for (; j > 0 && (uintptr_t)order[j - 1] > (uintptr_t)set[i]; j--) order[j] = order[j - 1];
+        order[j] = set[i];
+    }
+
+    int held = -1; // taken by a blocking wait, kept for the next attempt
+    for (;;)
+    {
+        int failed = 0;
+        while (failed < n && (failed == held || SemaphoreTryWait(order[failed]))) failed++;
+        if (failed == n) break;
+        for (int i = failed - 1; i >= 0; i--)
+            if (i != held) SemaphoreSignal(order[i]);
+        if (held >= 0) SemaphoreSignal(order[held]);
+        SemaphoreWait(order[failed]);
+        held = failed;
+    }
+    if (order != local) free(order);
+}
+
+void SemaphoreSignalAll(Semaphore *set, int n)
+{
+    for (int i = 0; i < n; i++) SemaphoreSignal(set[i]);
+}
+
+void SemaphoreFree(Semaphore s)
+{
+    int locked = pthread_mutex_lock(&semaphoreNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+
+    // swap the last registered semaphore into our slot.
+    Semaphore last = SemaphoreAt(threadPool.semLogicalLength - 1);
+    *RegistrySlot(&threadPool.semaphores, s->index) = last;
+    last->index = s->index;
+    threadPool.semLogicalLength --;
+
+    int unlocked = pthread_mutex_unlock(&semaphoreNewLock);
+    if (unlocked != 0) perror("pthread_mutex_unlock error");
+
+    free(s->stats);
+    SlabRelease(s, sizeof(struct SemaphoreImplementation) + strlen(s->debugName) + 1);
+}
+
+void EnableSemaphoreStats(bool enabled)
+{
+    statsFlag = enabled;
+}
+
+bool SemaphoreGetStats(Semaphore s, SemaphoreStats *out)
+{
+    SemaphoreCounters *stats = s->stats;
+    if (stats == NULL) return false;
+
+    out->acquisitions = atomic_load_explicit(&stats->acquisitions, memory_order_relaxed);
+    out->contendedWaits = atomic_load_explicit(&stats->contendedWaits, memory_order_relaxed);
+    out->totalBlockedNs = atomic_load_explicit(&stats->totalBlockedNs, memory_order_relaxed);
+    out->maxBlockedNs = atomic_load_explicit(&stats->maxBlockedNs, memory_order_relaxed);
+    for (int i = 0; i < SEMAPHORE_HISTOGRAM_BUCKETS; i++)
+    {
+        out->waitHistogram[i] = atomic_load_explicit(&stats->waitHistogram[i], memory_order_relaxed);
+    }
+    return true;
+}
+
+void SemaphoreResetStats(Semaphore s)
+{
+    SemaphoreCounters *stats = s->stats;
+    if (stats == NULL) return;
+
+    atomic_store_explicit(&stats->acquisitions, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->contendedWaits, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->totalBlockedNs, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats->maxBlockedNs, 0, memory_order_relaxed);
+    for (int i = 0; i < SEMAPHORE_HISTOGRAM_BUCKETS; i++)
+    {
+        atomic_store_explicit(&stats->waitHistogram[i], 0, memory_order_relaxed);
+    }
+}
+
+WaitGroup WaitGroupNew(int count)
+{
+    WaitGroup wg = malloc(sizeof(struct WaitGroupImplementation));
+    if (wg == NULL)
+    {
+        perror("malloc error");
+        return NULL;
+    }
+    atomic_init(&wg->count, count);
+    atomic_init(&wg->waiters, 0);
+    return wg;
+}
+
+void WaitGroupAdd(WaitGroup wg, int delta)
+{
+    atomic_fetch_add(&wg->count, delta);
+}
+
+void WaitGroupDone(WaitGroup wg)
+{
+    // only the completion that reaches zero may enter the kernel.
+    if (atomic_fetch_sub(&wg->count, 1) == 1 && atomic_load(&wg->waiters) > 0)
+        FutexWake(&wg->count, INT32_MAX);
+}
+
+void WaitGroupWait(WaitGroup wg)
+{
+    int count = atomic_load(&wg->count);
+    if (count == 0) return;
+
+    atomic_fetch_add(&wg->waiters, 1);
+    while ((count = atomic_load(&wg->count)) != 0)
+    {
+        FutexWait(&wg->count, count);
+    }
+    atomic_fetch_sub_explicit(&wg->waiters, 1, memory_order_relaxed);
+}
+
+void WaitGroupFree(WaitGroup wg)
+{
+    free(wg);
+}
+
+Channel ChannelNew(const char *debugName, size_t elemSize, int capacity)
+{
+    size_t slots = 2;
+    while (slots < (size_t)capacity) slots <<= 1;
+
+    size_t nameLength = strlen(debugName) + 1;
+    Channel c = NULL;
+    if (posix_memalign((void **)&c, CACHE_LINE_SIZE, sizeof(struct ChannelImplementation) + nameLength) != 0)
+    {
+        perror("posix_memalign error");
+        return NULL;
+    }
+
+    // keep every payload aligned like malloc'd memory.
+    size_t align = _Alignof(max_align_t);
+    c->cellSize = (sizeof(ChannelCell) + elemSize + align - 1) / align * align;
+    c->elemSize = elemSize;
+    c->mask = slots - 1;
+    if (posix_memalign((void **)&c->cells, CACHE_LINE_SIZE, c->cellSize * slots) != 0)
+    {
+        perror("posix_memalign error");
+        free(c);
+        return NULL;
+    }
+    for (size_t i = 0; i < slots; i++)
+    {
+        atomic_init(&((ChannelCell *)(c->cells + i * c->cellSize))->sequence, i);
+    }
+
+    atomic_init(&c->enqueuePos, 0);
+    atomic_init(&c->dequeuePos, 0);
+    atomic_init(&c->sendEvents, 0);
+    atomic_init(&c->sendWaiters, 0);
+    atomic_init(&c->receiveEvents, 0);
+    atomic_init(&c->receiveWaiters, 0);
+    memcpy(c->debugName, debugName, nameLength);
+    return c;
+}
+
+const char *ChannelName(Channel c)
+{
+    return c->debugName;
+}
+
+int ChannelCapacity(Channel c)
+{
+    return (int)(c->mask + 1);
+}
+
+static inline ChannelCell *ChannelCellAt(Channel c, size_t pos)
+{
+    return (ChannelCell *)(c->cells + (pos & c->mask) * c->cellSize);
+}
+
+// the lock-free enqueue, no wake-ups.
+static bool ChannelPush(Channel c, const void *elem)
+{
+    size_t pos = atomic_load_explicit(&c->enqueuePos, memory_order_relaxed);
+    ChannelCell *cell;
+    for (;;)
+    {
+        cell = ChannelCellAt(c, pos);
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&c->enqueuePos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) return false; // full
+        else pos = atomic_load_explicit(&c->enqueuePos, memory_order_relaxed);
+    }
+    memcpy(cell + 1, elem, c->elemSize);
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+// the lock-free dequeue, no wake-ups.
+static bool ChannelPop(Channel c, void *elem)
+{
+    size_t pos = atomic_load_explicit(&c->dequeuePos, memory_order_relaxed);
+    ChannelCell *cell;
+    for (;;)
+    {
+        cell = ChannelCellAt(c, pos);
+        size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&c->dequeuePos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0) return false; // empty
+        else pos = atomic_load_explicit(&c->dequeuePos, memory_order_relaxed);
+    }
+    memcpy(elem, cell + 1, c->elemSize);
+    atomic_store_explicit(&cell->sequence, pos + c->mask + 1, memory_order_release);
+    return true;
+}
+
+// ChannelPush with the signature ChannelBlock expects.
+static bool ChannelPushOp(Channel c, void *elem)
+{
+    return ChannelPush(c, elem);
+}
+
+// publish a state change and wake up to n peers parked on events.
+static inline void NotifyEvent(atomic_int *events, atomic_int *waiters, int n)
+{
+    atomic_fetch_add(events, 1);
+    if (atomic_load(waiters) > 0) FutexWake(events, n);
+}
+
+// spin, then park on events until op succeeds.
+static void ChannelBlock(Channel c, bool (*op)(Channel, void *), void *elem,
+                         atomic_int *events, atomic_int *waiters)
+{
+    for (int spin = 0; spin < SEMAPHORE_SPIN_LIMIT; spin++)
+    {
+        if (op(c, elem)) return;
+        CpuRelax();
+    }
+
+    atomic_fetch_add(waiters, 1);
+    for (;;)
+    {
+        int seen = atomic_load(events);
+        if (op(c, elem)) break;
+        FutexWait(events, seen);
+    }
+    atomic_fetch_sub_explicit(waiters, 1, memory_order_relaxed);
+}
+
+bool ChannelTrySend(Channel c, const void *elem)
+{
+    if (!ChannelPush(c, elem)) return false;
+    NotifyEvent(&c->receiveEvents, &c->receiveWaiters, 1);
+    return true;
+}
+
+bool ChannelTryReceive(Channel c, void *elem)
+{
+    if (!ChannelPop(c, elem)) return false;
+    NotifyEvent(&c->sendEvents, &c->sendWaiters, 1);
+    return true;
+}
+
+void ChannelSend(Channel c, const void *elem)
+{
+    ChannelBlock(c, ChannelPushOp, (void *)elem, &c->sendEvents, &c->sendWaiters);
+    NotifyEvent(&c->receiveEvents, &c->receiveWaiters, 1);
+}
+
+void ChannelReceive(Channel c, void *elem)
+{
+    ChannelBlock(c, ChannelPop, elem, &c->receiveEvents, &c->receiveWaiters);
+    NotifyEvent(&c->sendEvents, &c->sendWaiters, 1);
+}
+
+int ChannelTrySendBatch(Channel c, const void *elems, int n)
+{
+    int sent = 0;
+    while (sent < n && ChannelPush(c, (const char *)elems + sent * c->elemSize)) sent++;
+    if (sent > 0) NotifyEvent(&c->receiveEvents, &c->receiveWaiters, sent);
+    return sent;
+}
+
+int ChannelTryReceiveBatch(Channel c, void *elems, int maxCount)
+{
+    int received = 0;
+    while (received < maxCount && ChannelPop(c, (char *)elems + received * c->elemSize)) received++;
+    if (received > 0) NotifyEvent(&c->sendEvents, &c->sendWaiters, received);
+    return received;
+}
+
+void ChannelSendBatch(Channel c, const void *elems, int n)
+{
+    int sent = ChannelTrySendBatch(c, elems, n);
+    while (sent < n)
+    {
+        // wait for room for one element, then push as many as fit.
+        ChannelSend(c, (const char *)elems + sent * c->elemSize);
+        sent++;
+        sent += ChannelTrySendBatch(c, (const char *)elems + sent * c->elemSize, n - sent);
+    }
+}
+
+int ChannelReceiveBatch(Channel c, void *elems, int maxCount)
+{
+    if (maxCount <= 0) return 0;
+    int received = ChannelTryReceiveBatch(c, elems, maxCount);
+    if (received > 0) return received;
+
+    ChannelReceive(c, elems);
+    return 1 + ChannelTryReceiveBatch(c, (char *)elems + c->elemSize, maxCount - 1);
+}
+
+void ChannelFree(Channel c)
+{
+    free(c->cells);
+    free(c);
+}
+
+ByteChannel ByteChannelNew(const char *debugName, size_t capacity)
+{
+    uint64_t bytes = 4 * BYTE_RECORD_ALIGN;
+    while (bytes < capacity) bytes <<= 1;
+
+    size_t nameLength = strlen(debugName) + 1;
+    ByteChannel c = NULL;
+    if (posix_memalign((void **)&c, CACHE_LINE_SIZE, sizeof(struct ByteChannelImplementation) + nameLength) != 0)
+    {
+        perror("posix_memalign error");
+        return NULL;
+    }
+    if (posix_memalign((void **)&c->ring, CACHE_LINE_SIZE, bytes) != 0)
+    {
+        perror("posix_memalign error");
+        free(c);
+        return NULL;
+    }
+    c->capacity = bytes;
+    atomic_init(&c->reservePos, 0);
+    atomic_init(&c->readPos, 0);
+    atomic_init(&c->releasePos, 0);
+    atomic_init(&c->spaceEvents, 0);
+    atomic_init(&c->spaceWaiters, 0);
+    atomic_init(&c->dataEvents, 0);
+    atomic_init(&c->dataWaiters, 0);
+    int inited = pthread_mutex_init(&c->reserveLock, NULL);
+    if (inited != 0) perror("pthread_mutex_init error");
+    memcpy(c->debugName, debugName, nameLength);
+    return c;
+}
+
+const char *ByteChannelName(ByteChannel c)
+{
+    return c->debugName;
+}
+
+size_t ByteChannelMaxMessage(ByteChannel c)
+{
+    // half the ring always fits contiguously once the ring drains.
+    return c->capacity / 2 - sizeof(ByteRecord);
+}
+
+static inline ByteRecord *ByteRecordAt(ByteChannel c, uint64_t pos)
+{
+    return (ByteRecord *)(c->ring + (pos & (c->capacity - 1)));
+}
+
+// claim a contiguous region for length payload bytes, NULL if there is no room.
+static ByteRecord *ByteChannelClaim(ByteChannel c, size_t length)
+{
+    uint64_t total = (sizeof(ByteRecord) + length + BYTE_RECORD_ALIGN - 1) / BYTE_RECORD_ALIGN * BYTE_RECORD_ALIGN;
+
+    pthread_mutex_lock(&c->reserveLock);
+    uint64_t pos = atomic_load_explicit(&c->reservePos, memory_order_relaxed);
+    uint64_t offset = pos & (c->capacity - 1);
+    uint64_t padding = (offset + total > c->capacity) ? c->capacity - offset : 0;
+    if (pos + padding + total - atomic_load(&c->releasePos) > c->capacity)
+    {
+        pthread_mutex_unlock(&c->reserveLock);
+        return NULL;
+    }
+
+    if (padding > 0)
+    {
+        ByteRecord *filler = ByteRecordAt(c, pos);
+        filler->total = (uint32_t)padding;
+        filler->length = 0;
+        atomic_store_explicit(&filler->tag, BYTE_RECORD_TAG(pos, BYTE_RECORD_PADDING), memory_order_relaxed);
+        pos += padding;
+    }
+    ByteRecord *record = ByteRecordAt(c, pos);
+    record->total = (uint32_t)total;
+    record->length = 0;
+    atomic_store_explicit(&record->tag, BYTE_RECORD_TAG(pos, BYTE_RECORD_RESERVED), memory_order_relaxed);
+
+    // consumers only look at headers below reservePos, so publish it last.
+    atomic_store_explicit(&c->reservePos, pos + total, memory_order_release);
+    pthread_mutex_unlock(&c->reserveLock);
+    return record;
+}
+
+// mark a taken record as done and move releasePos over every finished record.
+static void ByteChannelRetire(ByteChannel c, ByteRecord *record, uint64_t pos)
+{
+    atomic_store(&record->tag, BYTE_RECORD_TAG(pos, BYTE_RECORD_RELEASED));
+
+    // records may be released out of order: whoever flips the header at
+    // releasePos is the only thread allowed to advance it past that record.
+    bool advanced = false;
+    for (;;)
+    {
+        uint64_t released = atomic_load(&c->releasePos);
+        if (released == atomic_load(&c->readPos)) break;
+        ByteRecord *head = ByteRecordAt(c, released);
+        uint32_t total = head->total;
+        uint64_t expected = BYTE_RECORD_TAG(released, BYTE_RECORD_RELEASED);
+        if (!atomic_compare_exchange_strong(&head->tag, &expected, BYTE_RECORD_TAG(released, BYTE_RECORD_RESERVED)))
+            break;
+        atomic_store(&c->releasePos, released + total);
+        advanced = true;
+    }
+    if (advanced) NotifyEvent(&c->spaceEvents, &c->spaceWaiters, INT32_MAX);
+}
+
+// take the oldest committed record, NULL if the head is not committed yet.
+static ByteRecord *ByteChannelTake(ByteChannel c)
+{
+    for (;;)
+    {
+        uint64_t pos = atomic_load(&c->readPos);
+        if (pos == atomic_load_explicit(&c->reservePos, memory_order_acquire)) return NULL;
+
+        ByteRecord *record = ByteRecordAt(c, pos);
+        uint64_t tag = atomic_load_explicit(&record->tag, memory_order_acquire);
+        bool padding = (tag == BYTE_RECORD_TAG(pos, BYTE_RECORD_PADDING));
+        if (!padding && tag != BYTE_RECORD_TAG(pos, BYTE_RECORD_COMMITTED)) return NULL;
+
+        uint32_t total = record->total;
+        if (!atomic_compare_exchange_weak(&c->readPos, &pos, pos + total)) continue;
+        if (!padding) return record;
+        ByteChannelRetire(c, record, pos);
+    }
+}
+
+void *ByteChannelTryReserve(ByteChannel c, size_t length)
+{
+    ByteRecord *record = ByteChannelClaim(c, length);
+    return record == NULL ? NULL : record + 1;
+}
+
+void *ByteChannelReserve(ByteChannel c, size_t length)
+{
+    if (length > ByteChannelMaxMessage(c))
+    {
+        fprintf(stderr, "ByteChannelReserve error: %zu bytes exceeds the %zu byte limit of %s\n",
+                length, ByteChannelMaxMessage(c), c->debugName);
+        return NULL;
+    }
+
+    ByteRecord *record;
+    for (int spin = 0; spin < SEMAPHORE_SPIN_LIMIT; spin++)
+    {
+        if ((record = ByteChannelClaim(c, length)) != NULL) return record + 1;
+        CpuRelax();
+    }
+
+    atomic_fetch_add(&c->spaceWaiters, 1);
+    for (;;)
+    {
+        int seen = atomic_load(&c->spaceEvents);
+        if ((record = ByteChannelClaim(c, length)) != NULL) break;
+        FutexWait(&c->spaceEvents, seen);
+    }
+    atomic_fetch_sub_explicit(&c->spaceWaiters, 1, memory_order_relaxed);
+    return record + 1;
+}
+
+void ByteChannelCommit(ByteChannel c, void *region, size_t length)
+{
+    ByteRecord *record = (ByteRecord *)region - 1;
+    uint64_t pos = atomic_load_explicit(&record->tag, memory_order_relaxed) >> 2;
+    record->length = (uint32_t)length;
+    atomic_store_explicit(&record->tag, BYTE_RECORD_TAG(pos, BYTE_RECORD_COMMITTED), memory_order_release);
+    NotifyEvent(&c->dataEvents, &c->dataWaiters, 1);
+}
+
+const void *ByteChannelTryAcquire(ByteChannel c, size_t *length)
+{
+    ByteRecord *record = ByteChannelTake(c);
+    if (record == NULL) return NULL;
+    *length = record->length;
+    return record + 1;
+}
+
+const void *ByteChannelAcquire(ByteChannel c, size_t *length)
+{
+    ByteRecord *record = NULL;
+    for (int spin = 0; spin < SEMAPHORE_SPIN_LIMIT && record == NULL; spin++)
+    {
+        if ((record = ByteChannelTake(c)) == NULL) CpuRelax();
+    }
+
+    if (record == NULL)
+    {
+        atomic_fetch_add(&c->dataWaiters, 1);
+        for (;;)
+        {
+            int seen = atomic_load(&c->dataEvents);
+            if ((record = ByteChannelTake(c)) != NULL) break;
+            FutexWait(&c->dataEvents, seen);
+        }
+        atomic_fetch_sub_explicit(&c->dataWaiters, 1, memory_order_relaxed);
+    }
+
+    *length = record->length;
+    return record + 1;
+}
+
+void ByteChannelRelease(ByteChannel c, const void *region)
+{
+    ByteRecord *record = (ByteRecord *)region - 1;
+    uint64_t pos = atomic_load_explicit(&record->tag, memory_order_relaxed) >> 2;
+    ByteChannelRetire(c, record, pos);
+}
+
+void ByteChannelFree(ByteChannel c)
+{
+    int destoryed = pthread_mutex_destroy(&c->reserveLock);
+    if (destoryed != 0) perror("pthread_mutex_destory error");
+    free(c->ring);
+    free(c);
+}
+
+Lock LockNew(const char *debugName)
+{
+    size_t nameLength = strlen(debugName) + 1;
+    Lock lock = NULL;
+    if (posix_memalign((void **)&lock, CACHE_LINE_SIZE, sizeof(struct LockImplementation) + nameLength) != 0)
+    {
+        perror("posix_memalign error");
+        return NULL;
+    }
+    atomic_init(&lock->state, 0);
+    lock->debugName = memcpy((char *)(lock + 1), debugName, nameLength);
+    return lock;
+}
+
+const char *LockName(Lock lock)
+{
+    return lock->debugName == NULL ? "striped lock" : lock->debugName;
+}
+
+Lock LockFor(const void *address)
+{
+    // fibonacci hashing, so neighbouring objects land on different stripes.
+    uint64_t hash = ((uint64_t)(uintptr_t)address >> 3) * 0x9E3779B97F4A7C15ull;
+    return &lockStripes[hash >> (64 - LOCK_STRIPE_BITS)];
+}
+
+void LockAcquire(Lock lock)
+{
+    int state = 0;
+    if (atomic_compare_exchange_strong(&lock->state, &state, 1)) return;
+
+    for (int spin = 0; spin < SEMAPHORE_SPIN_LIMIT; spin++)
+    {
+        CpuRelax();
+        state = 0;
+        if (atomic_load_explicit(&lock->state, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak(&lock->state, &state, 1))
+            return;
+    }
+
+    // mark the lock contended so the holder knows to wake somebody.
+    while (atomic_exchange(&lock->state, 2) != 0)
+    {
+        FutexWait(&lock->state, 2);
+    }
+}
+
+void LockRelease(Lock lock)
+{
+    if (atomic_fetch_sub(&lock->state, 1) != 1)
+    {
+        atomic_store(&lock->state, 0);
+        FutexWake(&lock->state, 1);
+    }
+}
+
+void LockFree(Lock lock)
+{
+    free(lock);
+}
+
+RWLock RWLockNew(const char *debugName, bool preferWriters)
+{
+    // two slots per core, so threads rarely share one.
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int slots = 2;
+    while (slots < 2 * cores && slots < RWLOCK_MAX_SLOTS) slots <<= 1;
+
+    size_t nameLength = strlen(debugName) + 1;
+    RWLock lock = NULL;
+    if (posix_memalign((void **)&lock, CACHE_LINE_SIZE, sizeof(struct RWLockImplementation) + nameLength) != 0)
+    {
+        perror("posix_memalign error");
+        return NULL;
+    }
+    if (posix_memalign((void **)&lock->slots, CACHE_LINE_SIZE, sizeof(RWLockSlot) * slots) != 0)
+    {
+        perror("posix_memalign error");
+        free(lock);
+        return NULL;
+    }
+    for (int i = 0; i < slots; i++) atomic_init(&lock->slots[i].readers, 0);
+    atomic_init(&lock->writer, RWLOCK_FREE);
+    atomic_init(&lock->readerWaiters, 0);
+    atomic_init(&lock->writerLock.state, 0);
+    atomic_init(&lock->drainEvents, 0);
+    atomic_init(&lock->drainWaiters, 0);
+    lock->writerLock.debugName = NULL;
+    lock->preferWriters = preferWriters;
+    lock->mask = slots - 1;
+    lock->debugName = memcpy((char *)(lock + 1), debugName, nameLength);
+    return lock;
+}
+
+const char *RWLockName(RWLock lock)
+{
+    return lock->debugName;
+}
+
+// the calling task's slot. A task keeps its slot wherever it runs (green
+// threads move between workers); other threads get one round-robin.
+static inline int ThreadSlot(void)
+{
+    static atomic_int nextSlot;
+    static __thread int threadSlot = -1;
+    if (currentThread != NULL) return currentThread->index;
+    if (threadSlot < 0) threadSlot = atomic_fetch_add_explicit(&nextSlot, 1, memory_order_relaxed) & INT32_MAX;
+    return threadSlot;
+}
+
+static inline RWLockSlot *RWLockSlotOf(RWLock lock)
+{
+    return &lock->slots[ThreadSlot() & lock->mask];
+}
+
+// whether readers must wait for the given writer state.
+static inline bool RWLockExcludesReaders(RWLock lock, int writer)
+{
+    return writer == RWLOCK_HELD || (writer == RWLOCK_PENDING && lock->preferWriters);
+}
+
+// drop a reader count, telling a draining writer when its slot empties.
+static inline void RWLockLeave(RWLock lock, RWLockSlot *slot)
+{
+    if (atomic_fetch_sub(&slot->readers, 1) == 1 && atomic_load(&lock->writer) != RWLOCK_FREE)
+        NotifyEvent(&lock->drainEvents, &lock->drainWaiters, 1);
+}
+
+void RWLockReadAcquire(RWLock lock)
+{
+    RWLockSlot *slot = RWLockSlotOf(lock);
+    for (;;)
+    {
+        // fast path: one increment of our own slot, then check for writers.
+        atomic_fetch_add(&slot->readers, 1);
+        int writer = atomic_load(&lock->writer);
+        if (!RWLockExcludesReaders(lock, writer)) return;
+
+        // a writer is in: back off so it can drain, and sleep until it is done.
+        RWLockLeave(lock, slot);
+        for (int spin = 0; spin < SEMAPHORE_SPIN_LIMIT && RWLockExcludesReaders(lock, writer); spin++)
+        {
+            CpuRelax();
+            writer = atomic_load(&lock->writer);
+        }
+        if (!RWLockExcludesReaders(lock, writer)) continue;
+        atomic_fetch_add(&lock->readerWaiters, 1);
+        while (RWLockExcludesReaders(lock, writer = atomic_load(&lock->writer)))
+        {
+            FutexWait(&lock->writer, writer);
+        }
+        atomic_fetch_sub_explicit(&lock->readerWaiters, 1, memory_order_relaxed);
+    }
+}
+
+void RWLockReadRelease(RWLock lock)
+{
+    RWLockLeave(lock, RWLockSlotOf(lock));
+}
+
+// true if no slot has a reader in it.
+static bool RWLockReadersGone(RWLock lock)
+{
+    for (int i = 0; i <= lock->mask; i++)
+    {
+        if (atomic_load(&lock->slots[i].readers) != 0) return false;
+    }
+    return true;
+}
+
+// wait until every slot has drained.
+static void RWLockDrain(RWLock lock)
+{
+    for (int spin = 0; spin < SEMAPHORE_SPIN_LIMIT; spin++)
+    {
+        if (RWLockReadersGone(lock)) return;
+        CpuRelax();
+    }
+
+    atomic_fetch_add(&lock->drainWaiters, 1);
+    for (;;)
+    {
+        int seen = atomic_load(&lock->drainEvents);
+        if (RWLockReadersGone(lock)) break;
+        FutexWait(&lock->drainEvents, seen);
+    }
+    atomic_fetch_sub_explicit(&lock->drainWaiters, 1, memory_order_relaxed);
+}
+
+static void RWLockSetWriter(RWLock lock, int writer)
+{
+    atomic_store(&lock->writer, writer);
+    if (atomic_load(&lock->readerWaiters) > 0) FutexWake(&lock->writer, INT32_MAX);
+}
+
+void RWLockWriteAcquire(RWLock lock)
+{
+    LockAcquire(&lock->writerLock);
+    // with writer preference new readers back off from here on.
+    atomic_store(&lock->writer, RWLOCK_PENDING);
+    for (;;)
+    {
+        RWLockDrain(lock);
+        // without it readers still come in while we drain: take the lock,
+        // then make sure no reader slipped in before it was visible.
+        atomic_store(&lock->writer, RWLOCK_HELD);
+        if (lock->preferWriters || RWLockReadersGone(lock)) return;
+        RWLockSetWriter(lock, RWLOCK_PENDING);
+    }
+}
+
+void RWLockWriteRelease(RWLock lock)
+{
+    RWLockSetWriter(lock, RWLOCK_FREE);
+    LockRelease(&lock->writerLock);
+}
+
+void RWLockFree(RWLock lock)
+{
+    free(lock->slots);
+    free(lock);
+}
+
+TokenPool TokenPoolNew(const char *debugName, long tokens)
+{
+    size_t nameLength = strlen(debugName) + 1;
+    TokenPool pool = NULL;
+    if (posix_memalign((void **)&pool, CACHE_LINE_SIZE, sizeof(struct TokenPoolImplementation) + nameLength) != 0)
+    {
+        perror("posix_memalign error");
+        return NULL;
+    }
+    atomic_init(&pool->remaining, tokens > 0 ? tokens : 0);
+    pool->debugName = memcpy((char *)(pool + 1), debugName, nameLength);
+    return pool;
+}
+
+const char *TokenPoolName(TokenPool pool)
+{
+    return pool->debugName;
+}
+
+static void TokenCacheReturn(TokenCache *cache)
+{
+    if (cache->count > 0) atomic_fetch_add(&cache->pool->remaining, cache->count);
+    cache->count = 0;
+}
+
+// the calling task's cache entry for pool, NULL outside ThreadNew tasks.
+static TokenCache *TokenCacheOf(TokenPool pool)
+{
+    if (currentThread == NULL) return NULL;
+    TokenCache *entries = currentThread->tokens;
+    TokenCache *empty = NULL;
+    for (int i = 0; i < TOKEN_CACHE_WAYS; i++)
+    {
+        if (entries[i].pool == pool) return &entries[i];
+        if (empty == NULL && entries[i].count == 0) empty = &entries[i];
+    }
+    TokenCache *cache = empty != NULL ? empty : &entries[(uintptr_t)pool / CACHE_LINE_SIZE % TOKEN_CACHE_WAYS];
+    if (cache->pool != NULL) TokenCacheReturn(cache);
+    cache->pool = pool;
+    cache->batch = TOKEN_LEASE_MIN;
+    return cache;
+}
+
+// exactly one token, false once the pool is empty.
+static bool TokenClaim(TokenPool pool)
+{
+    long left = atomic_load_explicit(&pool->remaining, memory_order_relaxed);
+    for (;;)
+    {
+        if (left < 0)
+        {
+            // a lease overshot and is about to give the excess back.
+            CpuRelax();
+            left = atomic_load_explicit(&pool->remaining, memory_order_relaxed);
+        }
+        else if (left == 0)
+        {
+            return false;
+        }
+        else if (atomic_compare_exchange_weak(&pool->remaining, &left, left - 1))
+        {
+            return true;
+        }
+    }
+}
+
+// up to batch tokens with one fetch-and-subtract, 0 if the pool is empty.
+static long TokenLease(TokenPool pool, long batch)
+{
+    long left = atomic_load_explicit(&pool->remaining, memory_order_relaxed);
+    if (batch > left / TOKEN_LEASE_SHARE) batch = left / TOKEN_LEASE_SHARE;
+    if (batch < 2) return TokenClaim(pool) ? 1 : 0;
+
+    long before = atomic_fetch_sub(&pool->remaining, batch);
+    if (before >= batch) return batch;
+    // others drained the pool since we looked: keep what there was, give back the rest.
+    long leased = before > 0 ? before : 0;
+    atomic_fetch_add(&pool->remaining, batch - leased);
+    if (leased == 0 && TokenClaim(pool)) leased = 1;
+    return leased;
+}
+
+bool TokenPoolTake(TokenPool pool)
+{
+    TokenCache *cache = TokenCacheOf(pool);
+    if (cache == NULL) return TokenClaim(pool);
+    if (cache->count == 0)
+    {
+        long leased = TokenLease(pool, cache->batch);
+        if (leased == 0) return false;
+        // a full lease means the pool is far from empty: ask for more next time.
+        if (leased == cache->batch && cache->batch < TOKEN_LEASE_MAX) cache->batch <<= 1;
+        cache->count = leased;
+    }
+    cache->count--;
+    return true;
+}
+
+void TokenPoolReturn(TokenPool pool)
+{
+    if (currentThread == NULL) return;
+    for (int i = 0; i < TOKEN_CACHE_WAYS; i++)
+        if (currentThread->tokens[i].pool == pool) TokenCacheReturn(&currentThread->tokens[i]);
+}
+
+long TokenPoolRemaining(TokenPool pool)
+{
+    long left = atomic_load(&pool->remaining);
+    return left > 0 ? left : 0;
+}
+
+void TokenPoolFree(TokenPool pool)
+{
+    free(pool);
+}
+
+Mailbox MailboxNew(const char *debugName)
+{
+    size_t nameLength = strlen(debugName) + 1;
+    Mailbox m = NULL;
+    if (posix_memalign((void **)&m, CACHE_LINE_SIZE, sizeof(struct MailboxImplementation) + nameLength) != 0)
+    {
+        perror("posix_memalign error");
+        return NULL;
+    }
+    m->pending = SemaphoreNew(debugName, 0);
+    if (m->pending == NULL)
+    {
+        free(m);
+        return NULL;
+    }
+    atomic_init(&m->lock.state, 0);
+    m->lock.debugName = NULL;
+    m->head = NULL;
+    m->tail = NULL;
+    m->closed = false;
+    m->debugName = memcpy((char *)(m + 1), debugName, nameLength);
+    return m;
+}
+
+const char *MailboxName(Mailbox m)
+{
+    return m->debugName;
+}
+
+// the semaphore a ThreadNew task blocks on while it waits for one thing at
+// a time (a reply, its turn in a queue), NULL outside tasks. It lives until
+// FreeThreadPackage, so whoever wakes the task may still touch it afterwards.
+static Semaphore TaskParker(void)
+{
+    if (currentThread == NULL) return NULL;
+    if (currentThread->parker == NULL) currentThread->parker = SemaphoreNew(currentThread->debugName, 0);
+    return currentThread->parker;
+}
+
+bool MailboxCall(Mailbox m, void *request, void **reply)
+{
+    struct MailboxEnvelopeImplementation envelope;
+    envelope.request = request;
+    envelope.reply = NULL;
+    envelope.next = NULL;
+    // other threads get a fresh semaphore per call.
+    envelope.temporary = currentThread == NULL;
+    envelope.replied = envelope.temporary ? SemaphoreNew("Mailbox reply", 0) : TaskParker();
+    if (envelope.replied == NULL) return false;
+    atomic_init(&envelope.released, false);
+
+    LockAcquire(&m->lock);
+    bool closed = m->closed;
+    if (!closed)
+    {
+        if (m->tail == NULL) m->head = &envelope;
+        else m->tail->next = &envelope;
+        m->tail = &envelope;
+    }
+    LockRelease(&m->lock);
+    if (!closed)
+    {
+        SemaphoreSignal(m->pending); // wakes one server
+        SemaphoreWait(envelope.replied); // woken by exactly our reply
+    }
+    if (envelope.temporary)
+    {
+        // the server may still be inside SemaphoreSignal on it.
+        while (!closed && !atomic_load_explicit(&envelope.released, memory_order_acquire)) CpuRelax();
+        SemaphoreFree(envelope.replied);
+    }
+    if (!closed && reply != NULL) *reply = envelope.reply;
+    return !closed;
+}
+
+MailboxEnvelope MailboxReceive(Mailbox m, void **request)
+{
+    SemaphoreWait(m->pending);
+    LockAcquire(&m->lock);
+    MailboxEnvelope envelope = m->head;
+    if (envelope != NULL)
+    {
+        m->head = envelope->next;
+        if (m->head == NULL) m->tail = NULL;
+    }
+    LockRelease(&m->lock);
+    if (envelope == NULL)
+    {
+        // closed and drained: pass the closing unit on to the next server.
+        SemaphoreSignal(m->pending);
+        return NULL;
+    }
+    if (request != NULL) *request = envelope->request;
+    return envelope;
+}
+
+void MailboxReply(MailboxEnvelope envelope, void *reply)
+{
+    // a task's client may return (and its envelope vanish) as soon as it is
+    // signalled, so read everything first. Other clients wait for released.
+    Semaphore replied = envelope->replied;
+    bool temporary = envelope->temporary;
+    envelope->reply = reply;
+    SemaphoreSignal(replied);
+    if (temporary) atomic_store_explicit(&envelope->released, true, memory_order_release);
+}
+
+void MailboxClose(Mailbox m)
+{
+    LockAcquire(&m->lock);
+    bool wasClosed = m->closed;
+    m->closed = true;
+    LockRelease(&m->lock);
+    if (!wasClosed) SemaphoreSignal(m->pending);
+}
+
+void MailboxFree(Mailbox m)
+{
+    SemaphoreFree(m->pending);
+    free(m);
+}
+
+QueueLock QueueLockNew(const char *debugName)
+{
+    size_t nameLength = strlen(debugName) + 1;
+    QueueLock lock = NULL;
+    if (posix_memalign((void **)&lock, CACHE_LINE_SIZE, sizeof(struct QueueLockImplementation) + nameLength) != 0)
+    {
+        perror("posix_memalign error");
+        return NULL;
+    }
+    atomic_init(&lock->tail, NULL);
+    lock->holder = NULL;
+    lock->debugName = memcpy((char *)(lock + 1), debugName, nameLength);
+    return lock;
+}
+
+const char *QueueLockName(QueueLock lock)
+{
+    return lock->debugName;
+}
+
+// wait until our predecessor hands the lock to node.
+static void QueueNodeWait(QueueNode *node)
+{
+    if (node->parker != NULL)
+    {
+        // tasks (green ones included) block the way semaphores do.
+        SemaphoreWait(node->parker);
+        return;
+    }
+    for (int spin = 0; spin < SEMAPHORE_SPIN_LIMIT; spin++)
+    {
+        if (atomic_load_explicit(&node->state, memory_order_acquire) == QUEUE_GRANTED) return;
+        CpuRelax();
+    }
+    int expected = QUEUE_WAITING;
+    if (atomic_compare_exchange_strong(&node->state, &expected, QUEUE_PARKED))
+    {
+        while (atomic_load_explicit(&node->state, memory_order_acquire) != QUEUE_GRANTED)
+            FutexWait(&node->state, QUEUE_PARKED);
+    }
+}
+
+static void QueueNodeGrant(QueueNode *node)
+{
+    // the waiter may free node once it sees the grant, read parker first.
+    Semaphore parker = node->parker;
+    if (parker != NULL)
+    {
+        SemaphoreSignal(parker);
+        return;
+    }
+    if (atomic_exchange(&node->state, QUEUE_GRANTED) == QUEUE_PARKED) FutexWake(&node->state, 1);
+}
+
+void QueueLockAcquire(QueueLock lock)
+{
+    QueueNode *node = SlabAlloc(sizeof(QueueNode));
+    if (node == NULL)
+    {
+        // without a node we can neither queue nor hold the lock, and
+        // returning would let the caller into its critical section unlocked.
+        fprintf(stderr, "thread_107: QueueLockAcquire(%s): out of memory\n", lock->debugName);
+        abort();
+    }
+    atomic_init(&node->next, NULL);
+    atomic_init(&node->state, QUEUE_WAITING);
+    node->parker = TaskParker();
+
+    QueueNode *predecessor = atomic_exchange(&lock->tail, node);
+    if (predecessor != NULL)
+    {
+        atomic_store_explicit(&predecessor->next, node, memory_order_release);
+        QueueNodeWait(node);
+    }
+    lock->holder = node;
+}
+
+bool QueueLockTryAcquire(QueueLock lock)
+{
+    if (atomic_load_explicit(&lock->tail, memory_order_relaxed) != NULL) return false;
+    QueueNode *node = SlabAlloc(sizeof(QueueNode));
+    if (node == NULL) return false;
+    atomic_init(&node->next, NULL);
+    atomic_init(&node->state, QUEUE_WAITING);
+    node->parker = NULL;
+
+    QueueNode *expected = NULL;
+    if (!atomic_compare_exchange_strong(&lock->tail, &expected, node))
+    {
+        SlabRelease(node, sizeof(QueueNode));
+        return false;
+    }
+    lock->holder = node;
+    return true;
+}
+
+void QueueLockRelease(QueueLock lock)
+{
+    QueueNode *node = lock->holder;
+    QueueNode *successor = atomic_load_explicit(&node->next, memory_order_acquire);
+    if (successor == NULL)
+    {
+        QueueNode *expected = node;
+        if (atomic_compare_exchange_strong(&lock->tail, &expected, NULL))
+        {
+            SlabRelease(node, sizeof(QueueNode));
+            return;
+        }
+        // a waiter swapped itself in as tail but has not linked up yet.
+        while ((successor = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL) CpuRelax();
+    }
+    SlabRelease(node, sizeof(QueueNode));
+    QueueNodeGrant(successor);
+}
+
+void QueueLockFree(QueueLock lock)
+{
+    free(lock);
+}
+
+Barrier BarrierNew(const char *debugName, int parties)
+{
+    if (parties < 1) parties = 1;
+    // leaves split the parties evenly, each level above groups BARRIER_FANIN nodes.
+    int nLeaves = parties <= BARRIER_TREE_MIN ? 1 : (parties + BARRIER_FANIN - 1) / BARRIER_FANIN;
+    int nNodes = 0;
+    for (int level = nLeaves; ; level = (level + BARRIER_FANIN - 1) / BARRIER_FANIN)
+    {
+        nNodes += level;
+        if (level == 1) break;
+    }
+
+    size_t nameLength = strlen(debugName) + 1;
+    Barrier b = NULL;
+    if (posix_memalign((void **)&b, CACHE_LINE_SIZE, sizeof(struct BarrierImplementation) + nameLength) != 0)
+    {
+        perror("posix_memalign error");
+        return NULL;
+    }
+    if (posix_memalign((void **)&b->nodes, CACHE_LINE_SIZE, sizeof(BarrierNode) * nNodes) != 0)
+    {
+        perror("posix_memalign error");
+        free(b);
+        return NULL;
+    }
+    b->gates[0] = SemaphoreNew(debugName, 0);
+    b->gates[1] = SemaphoreNew(debugName, 0);
+    if (b->gates[0] == NULL || b->gates[1] == NULL)
+    {
+        if (b->gates[0] != NULL) SemaphoreFree(b->gates[0]);
+        if (b->gates[1] != NULL) SemaphoreFree(b->gates[1]);
+        free(b->nodes);
+        free(b);
+        return NULL;
+    }
+    for (int i = 0; i < nLeaves; i++)
+    {
+        atomic_init(&b->nodes[i].word, 0);
+        b->nodes[i].capacity = parties / nLeaves + (i < parties % nLeaves);
+    }
+    int levelStart = 0, levelSize = nLeaves;
+    while (levelSize > 1)
+    {
+        int parentStart = levelStart + levelSize;
+        int parentSize = (levelSize + BARRIER_FANIN - 1) / BARRIER_FANIN;
+        for (int i = 0; i < parentSize; i++)
+        {
+            BarrierNode *parent = &b->nodes[parentStart + i];
+            atomic_init(&parent->word, 0);
+            parent->capacity = 0;
+        }
+        for (int i = 0; i < levelSize; i++)
+        {
+            b->nodes[levelStart + i].parent = parentStart + i / BARRIER_FANIN;
+            b->nodes[parentStart + i / BARRIER_FANIN].capacity++;
+        }
+        levelStart = parentStart;
+        levelSize = parentSize;
+    }
+    b->nodes[nNodes - 1].parent = -1;
+
+    atomic_init(&b->generation, 0);
+    atomic_init(&b->sleepers, 0);
+    b->greenParked = 0;
+    b->parties = parties;
+    // spinning only pays when the last party can be running meanwhile.
+    b->spinLimit = parties <= sysconf(_SC_NPROCESSORS_ONLN) ? BARRIER_SPIN_LIMIT : 0;
+    b->nLeaves = nLeaves;
+    b->nNodes = nNodes;
+    b->debugName = memcpy((char *)(b + 1), debugName, nameLength);
+    return b;
+}
+
+const char *BarrierName(Barrier b)
+{
+    return b->debugName;
+}
+
+// count one arrival at node for generation, true if it filled the node.
+// false with *full set means the node has no room left this generation.
+static bool BarrierNodeArrive(BarrierNode *node, uint32_t generation, bool *full)
+{
+    unsigned long long word = atomic_load_explicit(&node->word, memory_order_relaxed);
+    for (;;)
+    {
+        uint32_t count = (uint32_t)word;
+        if ((uint32_t)(word >> 32) != generation || count >= (uint32_t)node->capacity)
+        {
+            *full = true;
+            return false;
+        }
+        unsigned long long next = count + 1 == (uint32_t)node->capacity
+                                      ? (unsigned long long)(generation + 1) << 32 // filled: re-arm it
+                                      : word + 1;
+        if (atomic_compare_exchange_weak_explicit(&node->word, &word, next, memory_order_acq_rel, memory_order_relaxed))
+        {
+            *full = false;
+            return count + 1 == (uint32_t)node->capacity;
+        }
+    }
+}
+
+// the last arrival opens the barrier for everybody waiting on generation.
+static void BarrierRelease(Barrier b)
+{
+    if (greenPool.numWorkers > 0)
+    {
+        Lock lock = InternalLockFor(b);
+        LockAcquire(lock);
+        int generation = atomic_fetch_add(&b->generation, 1);
+        int parked = b->greenParked;
+        b->greenParked = 0;
+        LockRelease(lock);
+        for (int i = 0; i < parked; i++) SemaphoreSignal(b->gates[generation & 1]);
+    }
+    else
+    {
+        atomic_fetch_add(&b->generation, 1);
+    }
+    if (atomic_load(&b->sleepers) > 0) FutexWake(&b->generation, INT32_MAX);
+}
+
+bool BarrierWait(Barrier b)
+{
+    // nobody can end this generation before we have arrived.
+    uint32_t generation = (uint32_t)atomic_load_explicit(&b->generation, memory_order_acquire);
+
+    // arrive at our leaf, or the next one with room, then climb while we fill nodes.
+    int index = ThreadSlot() % b->nLeaves;
+    bool filled, full;
+    while (!(filled = BarrierNodeArrive(&b->nodes[index], generation, &full)) && full)
+        index = (index + 1) % b->nLeaves;
+    while (filled)
+    {
+        int parent = b->nodes[index].parent;
+        if (parent < 0)
+        {
+            BarrierRelease(b);
+            return true;
+        }
+        index = parent;
+        filled = BarrierNodeArrive(&b->nodes[index], generation, &full);
+    }
+
+    if (GreenSelf() != NULL)
+    {
+        // green threads must not block their worker: park on the gate.
+        Lock lock = InternalLockFor(b);
+        LockAcquire(lock);
+        bool park = (uint32_t)atomic_load(&b->generation) == generation;
+        if (park) b->greenParked++;
+        LockRelease(lock);
+        if (park) SemaphoreWait(b->gates[generation & 1]);
+        return false;
+    }
+    for (int spin = 0; spin < b->spinLimit; spin++)
+    {
+        if ((uint32_t)atomic_load_explicit(&b->generation, memory_order_acquire) != generation) return false;
+        CpuRelax();
+    }
+    atomic_fetch_add(&b->sleepers, 1);
+    while ((uint32_t)atomic_load_explicit(&b->generation, memory_order_acquire) == generation)
+        FutexWait(&b->generation, (int)generation);
+    atomic_fetch_sub_explicit(&b->sleepers, 1, memory_order_relaxed);
+    return false;
+}
+
+int BarrierParties(Barrier b)
+{
+    return b->parties;
+}
+
+void BarrierFree(Barrier b)
+{
+    SemaphoreFree(b->gates[0]);
+    SemaphoreFree(b->gates[1]);
+    free(b->nodes);
+    free(b);
+}
+
+// master seed every ThreadRandom stream is derived from, see ThreadRandomSeed.
+static uint64_t randomSeed = 0x107;
+// ThreadRandom state of threads that are not tasks, e.g. the main thread.
+static __thread uint64_t threadRandom[4];
+static __thread uint64_t threadRandomStream;
+
+static inline uint64_t SplitMix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// stream number k of the master seed, so any seed and k give well-mixed,
+// unrelated states.
+static void RandomSeedState(uint64_t state[4], uint64_t stream)
+{
+    uint64_t x = randomSeed;
+    uint64_t mixed = SplitMix64(&x) ^ stream;
+    x = SplitMix64(&mixed);
+    for (int i = 0; i < 4; i++) state[i] = SplitMix64(&x);
+    if ((state[0] | state[1] | state[2] | state[3]) == 0) state[0] = 1; // xoshiro's one bad state
+}
+
+// the caller's state: a task's own (green threads take it along to any
+// worker), else the OS thread's. Task k draws from stream k; other threads
+// from streams 2^63, 2^63 + 1, ... in the order they first draw.
+static inline uint64_t *RandomState(void)
+{
+    static atomic_ullong nextStream = 1ull << 63;
+    uint64_t *state = currentThread != NULL ? currentThread->random : threadRandom;
+    if ((state[0] | state[1] | state[2] | state[3]) == 0)
+    {
+        uint64_t stream;
+        if (currentThread != NULL) stream = (uint64_t)currentThread->index;
+        else stream = threadRandomStream = atomic_fetch_add_explicit(&nextStream, 1, memory_order_relaxed);
+        RandomSeedState(state, stream);
+    }
+    return state;
+}
+
+static inline uint64_t RandomRotate(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t RandomNext(uint64_t s[4])
+{
+    uint64_t result = RandomRotate(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = RandomRotate(s[3], 45);
+    return result;
+}
+
+void ThreadRandomSeed(uint64_t seed)
+{
+    randomSeed = seed;
+    if (currentThread != NULL) RandomSeedState(currentThread->random, (uint64_t)currentThread->index);
+    else if ((threadRandom[0] | threadRandom[1] | threadRandom[2] | threadRandom[3]) != 0)
+        RandomSeedState(threadRandom, threadRandomStream);
+}
+
+uint64_t ThreadRandom(void)
+{
+    return RandomNext(RandomState());
+}
+
+// Lemire's multiply-shift: the high word of x * bound, redrawing the rare x
+// whose low word falls into the 2^64 mod bound values that would bias it.
+uint64_t ThreadRandomBelow(uint64_t bound)
+{
+    uint64_t *state = RandomState();
+    if (bound == 0) return RandomNext(state);
+    unsigned __int128 m = (unsigned __int128)RandomNext(state) * bound;
+    uint64_t low = (uint64_t)m;
+    if (low < bound)
+    {
+        uint64_t threshold = -bound % bound;
+        while (low < threshold)
+        {
+            m = (unsigned __int128)RandomNext(state) * bound;
+            low = (uint64_t)m;
+        }
+    }
+    return (uint64_t)(m >> 64);
+}
+
+int64_t ThreadRandomRange(int64_t low, int64_t high)
+{
+    if (high < low) return low;
+    return (int64_t)((uint64_t)low + ThreadRandomBelow((uint64_t)high - (uint64_t)low + 1));
+}
+
+double ThreadRandomDouble(void)
+{
+    return (RandomNext(RandomState()) >> 11) * 0x1.0p-53;
+}
+
+void ThreadRandomFill(void *buffer, size_t length)
+{
+    uint64_t *shared = RandomState();
+    uint64_t state[4] = { shared[0], shared[1], shared[2], shared[3] }; // kept in registers
+    char *out = buffer;
+    for (; length >= sizeof(uint64_t); length -= sizeof(uint64_t), out += sizeof(uint64_t))
+    {
+        uint64_t value = RandomNext(state);
+        memcpy(out, &value, sizeof(value));
+    }
+    if (length > 0)
+    {
+        uint64_t value = RandomNext(state);
+        memcpy(out, &value, length);
+    }
+    memcpy(shared, state, sizeof(state));
+}
+
+// a task that ends gives back what it leased, so no token is stranded.
+static void TokenCacheFlush(ThreadInfo *t_info)
+{
+    for (int i = 0; i < TOKEN_CACHE_WAYS; i++)
+        if (t_info->tokens[i].pool != NULL) TokenCacheReturn(&t_info->tokens[i]);
+}
+
+void AcquireLibraryLock(void)
+{
+    int locked = pthread_mutex_lock(&mutexLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+}
+
+void ReleaseLibraryLock(void)
+{
+    int unlocked = pthread_mutex_unlock(&mutexLock);
+    if (unlocked != 0) perror("pthread_mutex_unlock error");
+}
+
+void ListAllThreads(void)
+{
+    // confirm that only one thread can call this function every single time
+    int locked = pthread_mutex_lock(&threadNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+
+    for (int i = 0; i < threadPool.logicalLength; i++)
+    {
+        ThreadInfo *t_info = ThreadInfoAt(i);
+        if (t_info->placement == NULL) printf("Thread's debugName is: %s\n", t_info->debugName);
+        else printf("Thread's debugName is: %s (pinned to CPU %d)\n", t_info->debugName, t_info->placement->cpus[0]);
+    }
+
+    int unlocked = pthread_mutex_unlock(&threadNewLock);
+    if (unlocked != 0) perror("pthread_mutex_unlock error");
+}
+
+void ListAllSemaphores(void)
+{
+    // confirm that only one thread can call this function every single time
+    int locked = pthread_mutex_lock(&semaphoreNewLock);
+    if (locked != 0) perror("pthread_mutex_lock error");
+
+    for (int i = 0; i < threadPool.semLogicalLength; i++)
+    {
+        Semaphore s = SemaphoreAt(i);
+        SemaphoreStats stats;
+        if (!SemaphoreGetStats(s, &stats))
+        {
+            printf("There is a Semaphores named %s\n", s->debugName);
+            continue;
+        }
+
+        printf("There is a Semaphores named %s: %lu acquisitions, %lu contended, "
+               "blocked %.3f ms total, %.3f ms max\n",
+               s->debugName, stats.acquisitions, stats.contendedWaits,
+               stats.totalBlockedNs / 1e6, stats.maxBlockedNs / 1e6);
+        for (int b = 0; b < SEMAPHORE_HISTOGRAM_BUCKETS; b++)
+        {
+            if (stats.waitHistogram[b] == 0) continue;
+            printf("    blocked >= %llu ns: %lu\n", 1ull << b, stats.waitHistogram[b]);
+        }
     }
 
     int unlocked = pthread_mutex_unlock(&semaphoreNewLock);
@@ -1,36 +1,195 @@
 #ifndef THREAD_107_H
 #define THREAD_107_H
 
-#ifdef __APPLE__
-#include <dispatch/dispatch.h>
-#else
-#include <semaphore.h>
-#endif
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
-struct SemaphoreImplementation {
-    #ifdef __APPLE__
-    dispatch_semaphore_t *__semaphore__;
-    #else
-    sem_t *__semaphore__;
-    #endif
-    const char *debugName;
-};
+#ifdef __cplusplus
+extern "C" {
+#endif
 
+// Semaphores are anonymous userspace objects (an atomic counter plus futex
+// wait/wake), so two semaphores created with the same debugName are distinct.
 typedef struct SemaphoreImplementation *Semaphore;
 
-void InitThreadPackage(bool traceFlag);
+// per-semaphore contention counters, see EnableSemaphoreStats.
+#define SEMAPHORE_HISTOGRAM_BUCKETS 32
+typedef struct {
+    unsigned long acquisitions; // successful waits
+    unsigned long contendedWaits; // waits that had to park
+    unsigned long long totalBlockedNs;
+    unsigned long long maxBlockedNs;
+    unsigned long waitHistogram[SEMAPHORE_HISTOGRAM_BUCKETS]; // [i]: parked [2^i, 2^(i+1)) ns
+} SemaphoreStats;
+
+// counts outstanding completions: each WaitGroupDone is one atomic decrement
+// and WaitGroupWait is woken once, when the count reaches zero.
+typedef struct WaitGroupImplementation *WaitGroup;
+
+// bounded lock-free multi-producer/multi-consumer queue of fixed-size
+// elements; blocking calls only enter the kernel when they have to park.
+typedef struct ChannelImplementation *Channel;
+
+// zero-copy ring of variable-size byte records: producers reserve a region,
+// fill it in place and commit it; consumers acquire a read-only view and
+// release it when done. Records are delivered in reservation order.
+typedef struct ByteChannelImplementation *ByteChannel;
+
+// a mutex on its own cache line, for PROTECT_WITH.
+typedef struct LockImplementation *Lock;
+
+// reader-writer lock for read-mostly data: readers register in per-thread
+// slots on separate cache lines, so concurrent readers share no written line,
+// and a writer waits for every slot to drain.
+typedef struct RWLockImplementation *RWLock;
+
+// fair FIFO lock: waiters get it strictly in arrival order. Each waiter
+// waits on a node of its own, so any number of them cost O(1) memory each
+// and the holder wakes exactly its successor.
+typedef struct QueueLockImplementation *QueueLock;
+
+// reusable barrier for phased work: each of a fixed number of parties waits
+// until all of them have arrived, then all go on into the next phase. Large
+// barriers count arrivals in a combining tree instead of on one word.
+typedef struct BarrierImplementation *Barrier;
+
+// a bounded count of tokens (tickets, slots, ...) that is never oversold.
+// Threads lease tokens in batches into a per-thread cache, so most takes
+// touch no shared memory; near exhaustion they are claimed one at a time.
+typedef struct TokenPoolImplementation *TokenPool;
+
+// request/response rendezvous: a client posts a request and blocks until a
+// server replies to that very request. Any number of servers take requests
+// in FIFO order, and each hand-off is one wake-up in each direction.
+typedef struct MailboxImplementation *Mailbox;
+typedef struct MailboxEnvelopeImplementation *MailboxEnvelope; // a request being served
+
+// returned by ThreadNew, -1 if the thread could not be created.
+typedef int ThreadId;
+
+// ThreadNewPrioritized and ThreadSetPriority take 0 (the default) up to this.
+#define THREAD_PRIORITY_MAX 7
+
+// how threads without an explicit ThreadPlaceOn/ThreadPlaceNear are pinned.
+typedef enum {
+    PLACEMENT_NONE, // not pinned, the kernel schedules freely (default)
+    PLACEMENT_COMPACT, // fill the hyperthreads of a core, then cores sharing a cache, then the next socket
+    PLACEMENT_SCATTER // one thread per socket, then per core, before any two share a core
+} PlacementPolicy;
+
+// what ThreadLog does when its thread's log buffer is full, see UseAsyncLog.
+typedef enum {
+    LOG_BLOCK, // wait for the flusher to make room
+    LOG_DROP // throw the record away, the flusher reports how many were lost
+} LogOverflow;
+
+void InitThreadPackage(bool traceFlag); // traceFlag turns on event tracing, see TraceDump
 void FreeThreadPackage();
-void ThreadNew(const char *debugName, void *(*func)(void *), int nArg, ...);
+ThreadId ThreadNew(const char *debugName, void *(*func)(void *), int nArg, ...);
+// ThreadNew for a thread that runs at priority from the start: higher
+// priorities go first in the green run queue, the worker pool queue and the
+// wait queue of prioritized semaphores; equal ones stay FIFO. The kernel is
+// not told: a task on an OS thread of its own (no UseGreenThreads or
+// UseWorkerPool) is only favoured when it waits on a prioritized semaphore,
+// and runs at the same OS priority as the rest.
+ThreadId ThreadNewPrioritized(const char *debugName, int priority, void *(*func)(void *), int nArg, ...);
 void ThreadSleep(int microSecs);
-const char *ThreadName(void);
+void ThreadSleepUntil(uint64_t deadlineNs); // absolute ThreadNowNanos() time
+uint64_t ThreadNowNanos(void); // CLOCK_MONOTONIC nanoseconds, the clock of all deadlines
+const char *ThreadName(void); // lock-free, NULL outside RunAllThreads threads
 void RunAllThreads(void);
+// opt-in: run ThreadNew tasks on numWorkers persistent OS threads (<= 0 means
+// one per online core) instead of one pthread each. Call before RunAllThreads.
+// Tasks that block on tasks queued behind them need enough workers to progress.
+void UseWorkerPool(int numWorkers);
+// opt-in M:N mode: run ThreadNew tasks as green threads (stackful coroutines
+// with stackSize-byte guard-paged stacks, 0 means 64 KiB) on numWorkers OS
+// threads (<= 0 means one per online core). Call before RunAllThreads.
+// SemaphoreWait and ThreadSleep switch to another green thread instead of
+// blocking; the other blocking calls (Channel, WaitGroup, Lock, RWLock,
+// LogFlush) hold up the whole worker, so keep them short.
+void UseGreenThreads(int numWorkers, size_t stackSize);
+// opt-in discrete-event simulation, after UseGreenThreads and before
+// RunAllThreads: ThreadNowNanos, ThreadSleep and timed waits follow a
+// simulation clock that starts at 0 and, once every green thread is blocked,
+// jumps straight to the earliest deadline. Sleeps cost no real time, and with
+// one worker every run takes the same course. Other threads (e.g. main) do
+// not move the clock, their sleeps and timed waits just watch it.
+void UseVirtualTime(void);
+// block until every launched thread (and any thread it created) has returned,
+// then reap their resources. Replaces the "SemaphoreWait(finish) N times" loop.
+void JoinAllThreads(void);
+// CPU placement (Linux; recorded but not applied elsewhere). Topology comes
+// from sysfs, restricted to the CPUs the process may use. Placing a thread
+// that already runs pins it at once. With UseWorkerPool only workers are pinned.
+void SetPlacementPolicy(PlacementPolicy policy); // for threads and workers launched afterwards
+void ThreadPlaceOn(ThreadId thread, const int *cpus, int nCpus); // explicit CPU list
+void ThreadPlaceNear(ThreadId thread, ThreadId other); // a CPU sharing other's L2, else L3, else socket
+// change the priority of an existing thread, see ThreadNewPrioritized. It
+// applies from the thread's next wait or trip through a run queue.
+void ThreadSetPriority(ThreadId thread, int priority);
 Semaphore SemaphoreNew(const char *debugName, int initialValue);
+// a semaphore that hands each signal to its highest-priority waiter. With
+// initialValue 1 it is a lock: the task holding it inherits the priority of
+// its waiters (and passes it on to a holder it waits for) until it signals.
+// Waits neither spin nor barge, so it costs a little more than SemaphoreNew.
+Semaphore SemaphoreNewPrioritized(const char *debugName, int initialValue);
 const char *SemaphoreName(Semaphore s); // get semaphore's debugName
 void SemaphoreWait(Semaphore s); // semaphore -1
 void SemaphoreSignal(Semaphore s); // semaphore +1
-void SemaphoreFree(Semaphore s); // free semaphore
+bool SemaphoreTryWait(Semaphore s); // semaphore -1 if it is positive, never blocks
+bool SemaphoreWaitFor(Semaphore s, uint64_t timeoutNs); // false if it timed out
+bool SemaphoreWaitUntil(Semaphore s, uint64_t deadlineNs); // false if deadlineNs passed
+// never blocks: true if a unit was taken at once, else false and resume(context)
+// is called once one has been taken for it, on the thread that signals it.
+bool SemaphoreWaitAsync(Semaphore s, void (*resume)(void *), void *context);
+// take one unit of every semaphore in set, or block holding none of them, so
+// callers with overlapping sets can not deadlock. It is not atomic: units are
+// taken one by one and given back with SemaphoreSignal when one is missing,
+// which can wake other waiters for nothing, and heavily contended overlapping
+// sets can keep backing off. A semaphore listed twice is taken twice.
+void SemaphoreWaitAll(Semaphore *set, int n);
+void SemaphoreSignalAll(Semaphore *set, int n); // semaphore +1 for each
+void SemaphoreFree(Semaphore s); // unregister and free semaphore
+// call after InitThreadPackage: semaphores created afterwards keep stats.
+// Off by default, and semaphores without stats pay only a NULL check.
+void EnableSemaphoreStats(bool enabled);
+bool SemaphoreGetStats(Semaphore s, SemaphoreStats *stats); // false if s keeps no stats
+void SemaphoreResetStats(Semaphore s);
+
+WaitGroup WaitGroupNew(int count);
+void WaitGroupAdd(WaitGroup wg, int delta); // count + delta
+void WaitGroupDone(WaitGroup wg); // count -1
+void WaitGroupWait(WaitGroup wg); // block until count is 0
+void WaitGroupFree(WaitGroup wg);
+
+// capacity is rounded up to a power of two, elements are copied in and out.
+Channel ChannelNew(const char *debugName, size_t elemSize, int capacity);
+const char *ChannelName(Channel c);
+int ChannelCapacity(Channel c);
+void ChannelSend(Channel c, const void *elem); // block while full
+void ChannelReceive(Channel c, void *elem); // block while empty
+bool ChannelTrySend(Channel c, const void *elem); // false if full
+bool ChannelTryReceive(Channel c, void *elem); // false if empty
+void ChannelSendBatch(Channel c, const void *elems, int n); // block until all n are sent
+int ChannelReceiveBatch(Channel c, void *elems, int maxCount); // block for >= 1, returns count
+int ChannelTrySendBatch(Channel c, const void *elems, int n); // returns count sent
+int ChannelTryReceiveBatch(Channel c, void *elems, int maxCount); // returns count received
+void ChannelFree(Channel c);
+
+// capacity in bytes is rounded up to a power of two.
+ByteChannel ByteChannelNew(const char *debugName, size_t capacity);
+const char *ByteChannelName(ByteChannel c);
+size_t ByteChannelMaxMessage(ByteChannel c); // largest length Reserve accepts
+void *ByteChannelReserve(ByteChannel c, size_t length); // block until length bytes are free
+void *ByteChannelTryReserve(ByteChannel c, size_t length); // NULL if no room
+void ByteChannelCommit(ByteChannel c, void *region, size_t length); // length <= reserved
+const void *ByteChannelAcquire(ByteChannel c, size_t *length); // block until a record is ready
+const void *ByteChannelTryAcquire(ByteChannel c, size_t *length); // NULL if none is ready
+void ByteChannelRelease(ByteChannel c, const void *region); // give the region back
+void ByteChannelFree(ByteChannel c);
 
 void AcquireLibraryLock(void);
 void ReleaseLibraryLock(void);
@@ -39,7 +198,102 @@ void ReleaseLibraryLock(void);
     code;                   \
     ReleaseLibraryLock();   \
 }
+
+Lock LockNew(const char *debugName);
+const char *LockName(Lock lock);
+Lock LockFor(const void *address); // one of a fixed table of striped locks, never freed
+void LockAcquire(Lock lock);
+void LockRelease(Lock lock);
+void LockFree(Lock lock);
+// like PROTECT, but independent locks do not serialize each other.
+#define PROTECT_WITH(lock, code) {                  \
+    Lock __protectLock__ = (lock);                  \
+    LockAcquire(__protectLock__);                   \
+    code;                                           \
+    LockRelease(__protectLock__);                   \
+}
+// for data without a natural lock: lock the stripe its address hashes to.
+#define PROTECT_ADDRESS(address, code) PROTECT_WITH(LockFor(address), code)
+
+QueueLock QueueLockNew(const char *debugName);
+const char *QueueLockName(QueueLock lock);
+void QueueLockAcquire(QueueLock lock); // after everybody who asked before
+bool QueueLockTryAcquire(QueueLock lock); // false unless it is free and nobody waits
+void QueueLockRelease(QueueLock lock); // hand the lock to the next in line
+void QueueLockFree(QueueLock lock);
+Barrier BarrierNew(const char *debugName, int parties);
+const char *BarrierName(Barrier b);
+int BarrierParties(Barrier b);
+// block until parties threads have called it in this phase. Returns true in
+// exactly one of them (the last to arrive), e.g. to report on the phase.
+bool BarrierWait(Barrier b);
+void BarrierFree(Barrier b);
+// preferWriters: a waiting writer stops new readers, so a steady stream of
+// readers can not starve it. Otherwise readers keep coming in until the
+// writer finds a moment without any.
+RWLock RWLockNew(const char *debugName, bool preferWriters);
+const char *RWLockName(RWLock lock);
+void RWLockReadAcquire(RWLock lock);
+void RWLockReadRelease(RWLock lock);
+void RWLockWriteAcquire(RWLock lock);
+void RWLockWriteRelease(RWLock lock);
+void RWLockFree(RWLock lock);
+#define PROTECT_READ(rwlock, code) {                \
+    RWLock __protectRWLock__ = (rwlock);            \
+    RWLockReadAcquire(__protectRWLock__);           \
+    code;                                           \
+    RWLockReadRelease(__protectRWLock__);           \
+}
+#define PROTECT_WRITE(rwlock, code) {               \
+    RWLock __protectRWLock__ = (rwlock);            \
+    RWLockWriteAcquire(__protectRWLock__);          \
+    code;                                           \
+    RWLockWriteRelease(__protectRWLock__);          \
+}
+TokenPool TokenPoolNew(const char *debugName, long tokens);
+const char *TokenPoolName(TokenPool pool);
+bool TokenPoolTake(TokenPool pool); // one token, false once all are taken
+// give back the caller's unused leased tokens, for a task that stops taking
+// early. Tasks give them back by themselves when they return.
+void TokenPoolReturn(TokenPool pool);
+long TokenPoolRemaining(TokenPool pool); // not leased yet, exact once no task holds any
+void TokenPoolFree(TokenPool pool); // after every task that took from it has ended
+Mailbox MailboxNew(const char *debugName);
+const char *MailboxName(Mailbox m);
+// post request and block for the reply (stored in *reply unless reply is
+// NULL), false at once if m is closed, so a NULL reply is still an answer.
+bool MailboxCall(Mailbox m, void *request, void **reply);
+// block for the oldest request (stored in *request), NULL once m is closed
+// and every queued request has been taken.
+MailboxEnvelope MailboxReceive(Mailbox m, void **request);
+void MailboxReply(MailboxEnvelope envelope, void *reply); // wakes that request's client
+void MailboxClose(Mailbox m); // queued requests are still served
+void MailboxFree(Mailbox m);
+// per-thread xoshiro256** generators, no locks and no shared state. Task k
+// (ThreadNew order) draws from stream k of one master seed, so runs are
+// reproducible; set the seed before the tasks start drawing.
+void ThreadRandomSeed(uint64_t seed);
+uint64_t ThreadRandom(void); // 64 random bits
+uint64_t ThreadRandomBelow(uint64_t bound); // uniform in [0, bound), bound 0 means 2^64
+int64_t ThreadRandomRange(int64_t low, int64_t high); // uniform in [low, high]
+double ThreadRandomDouble(void); // uniform in [0, 1), 53 random bits
+void ThreadRandomFill(void *buffer, size_t length); // length random bytes
+// after UseAsyncLog, ThreadLog formats into a per-thread buffer and a
+// flusher thread writes the records to path (NULL: stdout) in timestamp
+// order; before it, ThreadLog is plain printf. FreeThreadPackage flushes.
+void UseAsyncLog(const char *path, LogOverflow overflow);
+void ThreadLog(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void LogFlush(void); // block until everything logged so far is written
+// InitThreadPackage(true) records thread start/stop and semaphore wait and
+// signal events into per-thread buffers. FreeThreadPackage dumps them to
+// $THREAD_107_TRACE (default "thread_107.trace"); TraceDump does it on demand.
+bool TraceDump(const char *path);
+bool TraceConvertToChrome(const char *tracePath, const char *jsonPath); // for chrome://tracing or Perfetto
 void ListAllThreads(void);
-void ListAllSemaphores(void);
+void ListAllSemaphores(void); // includes contention stats when they are kept
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
@@ -0,0 +1,384 @@
+#ifndef THREAD_107_HPP
+#define THREAD_107_HPP
+
+// C++20 coroutine front-end for thread_107.
+//
+// Tasks are ordinary coroutines with typed parameters and results instead of
+// ThreadNew's void *args arrays, and `co_await sem.wait()` suspends the
+// coroutine instead of blocking a thread: the suspended coroutine is queued on
+// the semaphore (SemaphoreWaitAsync) and handed back to a Scheduler thread
+// once SemaphoreSignal has taken a unit for it. So thousands of pending waits
+// cost a few bytes of coroutine frame each and no thread at all.
+//
+//     thread107::task<int> Seller(thread107::Semaphore &lock, int &tickets) { ... }
+//
+//     thread107::Scheduler scheduler(4);
+//     scheduler.spawn(Seller(lock, tickets)); // fire and forget
+//     int sold = scheduler.run(Seller(lock, tickets)); // block for the result
+//
+// Compile with -std=c++20 and link thread_107.c as usual. Call
+// InitThreadPackage before creating semaphores.
+
+#include "thread_107.h"
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace thread107 {
+
+// a few OS threads that resume runnable coroutines in FIFO order.
+class Scheduler {
+public:
+    // nThreads <= 0 means one per online core.
+    explicit Scheduler(int nThreads = 0)
+    {
+        if (nThreads <= 0) nThreads = static_cast<int>(std::thread::hardware_concurrency());
+        if (nThreads <= 0) nThreads = 1;
+        for (int i = 0; i < nThreads; i++) threads_.emplace_back([this] { loop(); });
+    }
+
+    // lets the queued coroutines run out first; coroutines still suspended on
+    // a semaphore are not resumed afterwards.
+    ~Scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            shuttingDown_ = true;
+        }
+        notEmpty_.notify_all();
+        for (std::thread &thread : threads_) thread.join();
+    }
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+    // make a suspended coroutine runnable, from any thread.
+    void post(std::coroutine_handle<> handle)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            runQueue_.push_back(handle);
+        }
+        notEmpty_.notify_one();
+    }
+
+    // `co_await scheduler.schedule()` moves the coroutine onto this scheduler.
+    auto schedule()
+    {
+        struct Awaiter {
+            Scheduler &scheduler;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { scheduler.post(handle); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{ *this };
+    }
+
+    // start a task on this scheduler and forget about it, its frame frees itself.
+    template <typename Task>
+    void spawn(Task task);
+
+    // start a task on this scheduler and block the calling thread (which must
+    // not be one of ours) until it has finished, returning its result.
+    template <typename Task>
+    auto run(Task task) -> typename Task::value_type;
+
+    // the scheduler whose thread is running the caller, nullptr elsewhere.
+    static Scheduler *current() { return current_; }
+
+private:
+    void loop()
+    {
+        current_ = this;
+        std::unique_lock<std::mutex> guard(lock_);
+        for (;;)
+        {
+            notEmpty_.wait(guard, [this] { return shuttingDown_ || !runQueue_.empty(); });
+            if (runQueue_.empty()) return;
+            std::coroutine_handle<> handle = runQueue_.front();
+            runQueue_.pop_front();
+            guard.unlock();
+            handle.resume();
+            guard.lock();
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable notEmpty_;
+    std::deque<std::coroutine_handle<>> runQueue_;
+    bool shuttingDown_ = false;
+    std::vector<std::thread> threads_;
+    static inline thread_local Scheduler *current_ = nullptr;
+};
+
+// RAII wrapper around a thread_107 Semaphore.
+class Semaphore {
+public:
+    Semaphore(const char *debugName, int initialValue) : native_(SemaphoreNew(debugName, initialValue))
+    {
+        if (native_ == nullptr) throw std::runtime_error("SemaphoreNew failed");
+    }
+    ~Semaphore()
+    {
+        if (native_ != nullptr) SemaphoreFree(native_);
+    }
+
+    Semaphore(Semaphore &&other) noexcept : native_(std::exchange(other.native_, nullptr)) {}
+    Semaphore &operator=(Semaphore &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (native_ != nullptr) SemaphoreFree(native_);
+            native_ = std::exchange(other.native_, nullptr);
+        }
+        return *this;
+    }
+    Semaphore(const Semaphore &) = delete;
+    Semaphore &operator=(const Semaphore &) = delete;
+
+    // `co_await sem.wait()`: take one unit, suspending the coroutine until a
+    // signal hands it one. It resumes on the scheduler it was running on.
+    auto wait()
+    {
+        struct Awaiter {
+            ::Semaphore native;
+            Scheduler *scheduler;
+            std::coroutine_handle<> handle;
+
+            bool await_ready() { return SemaphoreTryWait(native); }
+            bool await_suspend(std::coroutine_handle<> awaiting)
+            {
+                handle = awaiting;
+                scheduler = Scheduler::current();
+                // once queued, the signaller may resume us at once: touch nothing after it.
+                return !SemaphoreWaitAsync(native, &Awaiter::resume, this);
+            }
+            void await_resume() const noexcept {}
+
+            static void resume(void *context)
+            {
+                Awaiter *self = static_cast<Awaiter *>(context);
+                if (self->scheduler != nullptr) self->scheduler->post(self->handle);
+                else self->handle.resume(); // not started from a scheduler: resume in place
+            }
+        };
+        return Awaiter{ native_, nullptr, {} };
+    }
+
+    void signal() { SemaphoreSignal(native_); }
+    bool try_wait() { return SemaphoreTryWait(native_); }
+    // blocks the calling thread, for code outside coroutines.
+    void blocking_wait() { SemaphoreWait(native_); }
+    const char *name() const { return SemaphoreName(native_); }
+    ::Semaphore native() const { return native_; }
+
+private:
+    ::Semaphore native_;
+};
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+// resumes whoever awaited the task when it finishes.
+struct final_awaiter {
+    bool await_ready() const noexcept { return false; }
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> finished) noexcept
+    {
+        std::coroutine_handle<> continuation = finished.promise().continuation;
+        return continuation ? continuation : std::noop_coroutine();
+    }
+    void await_resume() const noexcept {}
+};
+
+struct promise_base {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    final_awaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() { exception = std::current_exception(); }
+    void rethrow()
+    {
+        if (exception) std::rethrow_exception(exception);
+    }
+};
+
+template <typename T>
+struct promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object();
+    template <typename U>
+    void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+    T take()
+    {
+        rethrow();
+        return std::move(*value);
+    }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object();
+    void return_void() const noexcept {}
+    void take() { rethrow(); }
+};
+
+} // namespace detail
+
+// a lazily started coroutine with a typed result: nothing runs until it is
+// co_awaited, spawned or run, and it resumes its awaiter when it returns.
+template <typename T>
+class [[nodiscard]] task {
+public:
+    using value_type = T;
+    using promise_type = detail::promise<T>;
+
+    task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (handle_) handle_.destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    ~task()
+    {
+        if (handle_) handle_.destroy();
+    }
+
+    auto operator co_await() && noexcept
+    {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+            bool await_ready() const noexcept { return !handle || handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle; // symmetric transfer, no stack growth
+            }
+            T await_resume() { return handle.promise().take(); }
+        };
+        return Awaiter{ handle_ };
+    }
+
+private:
+    friend promise_type;
+    explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T>
+task<T> promise<T>::get_return_object()
+{
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object()
+{
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+// the frame of a spawned task: owns it and frees itself when it is done.
+struct detached {
+    struct promise_type {
+        detached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+template <typename Task>
+detached spawn_detached(Scheduler &scheduler, Task task)
+{
+    co_await scheduler.schedule();
+    co_await std::move(task);
+}
+
+// where run() waits for its task. A mutex and condition variable rather than
+// a Semaphore, which run() would free while the signaller may still touch it.
+template <typename Result>
+struct run_state {
+    std::mutex lock;
+    std::condition_variable finished;
+    bool done = false;
+    std::optional<Result> result;
+    std::exception_ptr exception;
+};
+
+template <typename Task, typename Result>
+detached run_detached(Scheduler &scheduler, Task task, run_state<Result> &state)
+{
+    co_await scheduler.schedule();
+    std::optional<Result> result;
+    std::exception_ptr exception;
+    try
+    {
+        if constexpr (std::is_void_v<typename Task::value_type>)
+        {
+            co_await std::move(task);
+            result.emplace();
+        }
+        else
+        {
+            result.emplace(co_await std::move(task));
+        }
+    }
+    catch (...)
+    {
+        exception = std::current_exception();
+    }
+    std::lock_guard<std::mutex> guard(state.lock);
+    state.result = std::move(result);
+    state.exception = exception;
+    state.done = true;
+    state.finished.notify_one();
+}
+
+struct empty {};
+
+} // namespace detail
+
+template <typename Task>
+void Scheduler::spawn(Task task)
+{
+    detail::spawn_detached(*this, std::move(task));
+}
+
+template <typename Task>
+auto Scheduler::run(Task task) -> typename Task::value_type
+{
+    using T = typename Task::value_type;
+    using Result = std::conditional_t<std::is_void_v<T>, detail::empty, T>;
+    detail::run_state<Result> state;
+    detail::run_detached(*this, std::move(task), state);
+    std::unique_lock<std::mutex> guard(state.lock);
+    state.finished.wait(guard, [&state] { return state.done; });
+    if (state.exception) std::rethrow_exception(state.exception);
+    if constexpr (!std::is_void_v<T>) return std::move(*state.result);
+}
+
+} // namespace thread107
+
+#endif
@@ -1,28 +1,39 @@
 /*
  * ticketSeller.c
  * ---------------
- * A very simple example of a critical section that is protected by a
- * semaphore lock. There is a global variable numTickets which tracks the
- * number of tickets remaining to sell. We will create many threads that all
- * will attempt to sell tickets until they are all gone. However, we must
- * control access to this global variable lest we sell more tickets than
- * really exist. We have a semaphore lock that will only allow one seller
- * thread to access the numTickets variable at a time. Before attempting to
- * sell a ticket, the thread must acquire the lock by waiting on the semaphore
- * and then release the lock when through by signalling the semaphore.
+ * A very simple example of allocating from a shared count. There is a
+ * global pool of tickets remaining to sell. We will create many threads that
+ * all will attempt to sell tickets until they are all gone. However, we must
+ * control access to the count lest we sell more tickets than really exist.
+ * Guarding it with a semaphore lock would let only one seller at a time
+ * touch the count, so sellers would spend most of their time handing the
+ * lock back and forth. Instead the tickets live in a TokenPool: each seller
+ * leases a batch of tickets at once and sells them from its own stash, and
+ * only near the end does it take them one by one. The pool never hands out
+ * more tickets than there are, and a seller that finishes gives back what it
+ * did not sell.
+ *
+ *     ./ticketSeller [-v] [numTickets numSellers]
+ *
+ * e.g. ./ticketSeller 10000000 32 sells ten million tickets in a few
+ * milliseconds. Only small runs print every sale.
  */
 #include "thread_107.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 
 #define NUM_TICKETS 40
 #define NUM_SELLERS 3
+#define CHATTY_TICKETS 1000 // print every sale up to this many tickets
 /**
- * The ticket counter and its associated lock will be accessed
- * all threads, so made global for easy access.
+ * The ticket pool will be accessed by all threads, so made global for
+ * easy access.
  */
-static int numTickets = NUM_TICKETS;
-static Semaphore ticketsLock;
-static Semaphore finish;
+static TokenPool tickets;
+static bool chatty;
+static atomic_long totalSold; // to check the pool sold every ticket exactly once
 
 
 /**
@@ -30,80 +41,71 @@ static Semaphore finish;
  * -----------
  * This is the routine forked by each of the ticket-selling threads.
  * It will loop selling tickets until there are no more tickets left
- * to sell. Before accessing the global numTickets variable,
- * it acquires the ticketsLock to ensure that our threads don't step
- * on one another and oversell on the number of tickets.
+ * to sell. TokenPoolTake hands each seller a ticket of its own, so
+ * our threads can't step on one another and oversell.
  */
 static void* SellTickets(void* l)
 {
-  bool done = false;
-  int numSoldByThisThread = 0; // local vars are unique to each thread
-  while (!done) {
+  long numSoldByThisThread = 0; // local vars are unique to each thread
   /**
   * imagine some code here which does something independent of
   * the other threads such as working with a customer to determine
-  * which tickets they want. Simulate with a small random delay
-  * to get random variations in output patterns.
+  * which tickets they want.
   */
-    SemaphoreWait(ticketsLock); // ENTER CRITICAL SECTION
-    if (numTickets == 0) { // here is safe to access numTickets
-      done = true; // a "break" here instead of done variable
-  // would be an error- why?
-    } else {
-
-      numTickets--;
-      numSoldByThisThread++;
-      printf("%s sold one (%d left)\n", ThreadName(), numTickets);
-    }
-    SemaphoreSignal(ticketsLock); // LEAVE CRITICAL SECTION
-    
+  while (TokenPoolTake(tickets)) { // false only once every ticket is gone
+    numSoldByThisThread++;
+    if (chatty) ThreadLog("%s sold one\n", ThreadName());
   }
   
-  printf("%s noticed all tickets sold! (I sold %d myself) \n", ThreadName(), numSoldByThisThread);
-
-    SemaphoreSignal(finish);
+  atomic_fetch_add(&totalSold, numSoldByThisThread);
+  ThreadLog("%s noticed all tickets sold! (I sold %ld myself) \n", ThreadName(), numSoldByThisThread);
+  return NULL;
 }
 
 
 /**
- * Our main is creates the initial semaphore lock in an unlocked state
- * (one thread can immediately acquire it) and sets up all of
- * the ticket seller threads, and lets them run to completion. They
- * should all finish when all tickets have been sold. By running with the
- * -v flag, it will include the trace output from the thread library.
+ * Our main is creates the ticket pool and sets up all of the ticket
+ * seller threads, and lets them run to completion. They should all
+ * finish when all tickets have been sold. By running with the -v flag,
+ * it will include the trace output from the thread library.
  */
 int main(int argc, char **argv)
 {
   int i;
   char name[32];
-  bool verbose = (argc == 2 && (strcmp(argv[1], "-v") == 0));
-
-
+  bool verbose = false;
+  long numTickets = NUM_TICKETS;
+  int numSellers = NUM_SELLERS;
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "-v") == 0) {
+    verbose = true;
+    arg++;
+  }
+  if (arg < argc) numTickets = atol(argv[arg++]);
+  if (arg < argc) numSellers = atoi(argv[arg++]);
+  if (numTickets < 0) numTickets = NUM_TICKETS;
+  if (numSellers < 1) numSellers = NUM_SELLERS;
+  chatty = numTickets <= CHATTY_TICKETS;
 
   InitThreadPackage(verbose);
-  ticketsLock = SemaphoreNew("Tickets Lock", 1);
-    finish = SemaphoreNew("done", 0);
-  ListAllSemaphores();
+  UseAsyncLog(NULL, LOG_BLOCK); // sellers log without taking stdout's lock
+  tickets = TokenPoolNew("Tickets", numTickets);
 
-  for (i = 0; i < NUM_SELLERS; i++) {
+  for (i = 0; i < numSellers; i++) {
     sprintf(name, "Seller #%d", i); // give each thread a distinct name
     ThreadNew(name, SellTickets, 1, NULL);
   }
-  ListAllThreads();
-    
+  if (chatty) ListAllThreads();
     
+  uint64_t start = ThreadNowNanos();
   RunAllThreads(); // Let all threads loose
+  JoinAllThreads(); // wait until every seller is done
+  LogFlush();
+  printf("Sold %ld of %ld tickets in %.3f ms\n", atomic_load(&totalSold), numTickets,
+         (ThreadNowNanos() - start) / 1e6);
     
-    // This thread is required becuase the library thread_107.h is not official.
-    // This library is provided by github open code
-    for(int i=0; i< NUM_SELLERS;i++){
-        SemaphoreWait(finish);
-    }
-    
-    
-    
-  SemaphoreFree(ticketsLock); // to be tidy, clean up
-    SemaphoreFree(finish);
+  TokenPoolFree(tickets); // to be tidy, clean up
+  FreeThreadPackage(); // also writes the trace when run with -v
   printf("All done!\n");
   return 0;
 }
@@ -0,0 +1,95 @@
+/*
+ * ticketSeller.cpp
+ * ----------------
+ * ticketSeller.c again, written against the C++ coroutine front-end in
+ * thread_107.hpp. Each seller is a coroutine with typed arguments and a
+ * typed result (how many tickets it sold) instead of a thread reading a
+ * void *args array, and waiting for the lock suspends the coroutine
+ * instead of blocking a thread, so NUM_SELLERS can be far larger than the
+ * number of threads the scheduler runs them on.
+ *
+ *     g++ -std=c++20 -x c++ ticketSeller.cpp -x c thread_107.c -o ticketSeller -w -g -lpthread
+ */
+#include "thread_107.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+#define NUM_TICKETS 40
+#define NUM_SELLERS 1000
+
+using thread107::Scheduler;
+using thread107::task;
+
+/**
+ * SellTickets
+ * -----------
+ * Loops selling tickets until there are none left, returning how many this
+ * seller sold. `co_await ticketsLock.wait()` gives the scheduler thread to
+ * another seller while this one waits for the lock, and after each sale the
+ * seller requeues itself behind the others.
+ */
+static task<int> SellTickets(int id, thread107::Semaphore &ticketsLock, int &numTickets)
+{
+  int numSoldByThisSeller = 0;
+  for (;;) {
+    co_await ticketsLock.wait(); // ENTER CRITICAL SECTION
+    if (numTickets == 0) {
+      ticketsLock.signal(); // LEAVE CRITICAL SECTION
+      break;
+    }
+    numTickets--;
+    numSoldByThisSeller++;
+    printf("Seller #%d sold one (%d left)\n", id, numTickets);
+    ticketsLock.signal(); // LEAVE CRITICAL SECTION
+    co_await Scheduler::current()->schedule(); // serve the next customer, other sellers go first
+  }
+  co_return numSoldByThisSeller;
+}
+
+/**
+ * SellAndReport
+ * -------------
+ * Runs one seller as its own spawned task, adds what it sold to the total
+ * and tells SellAll it is done.
+ */
+static task<void> SellAndReport(int id, thread107::Semaphore &ticketsLock, int &numTickets,
+                                std::atomic<int> &total, thread107::Semaphore &sellersDone)
+{
+  total += co_await SellTickets(id, ticketsLock, numTickets);
+  sellersDone.signal();
+}
+
+/**
+ * Spawns every seller on the scheduler, so they all compete for the lock
+ * at once, then waits for each to finish and returns what they sold.
+ * Awaiting the sellers' tasks directly would start each one only after the
+ * previous one had sold out, since a task does not run until awaited.
+ */
+static task<int> SellAll(Scheduler &scheduler, thread107::Semaphore &ticketsLock, int &numTickets,
+                         thread107::Semaphore &sellersDone)
+{
+  std::atomic<int> total{0};
+  for (int i = 0; i < NUM_SELLERS; i++)
+    scheduler.spawn(SellAndReport(i, ticketsLock, numTickets, total, sellersDone));
+  for (int i = 0; i < NUM_SELLERS; i++)
+    co_await sellersDone.wait();
+  co_return total.load();
+}
+
+int main(int argc, char **argv)
+{
+  bool verbose = (argc == 2 && (strcmp(argv[1], "-v") == 0));
+  InitThreadPackage(verbose);
+  {
+    thread107::Semaphore ticketsLock("Tickets Lock", 1);
+    thread107::Semaphore sellersDone("Sellers Done", 0); // outlives the scheduler's last signal
+    int numTickets = NUM_TICKETS;
+    Scheduler scheduler(2); // two threads for all the sellers
+    int sold = scheduler.run(SellAll(scheduler, ticketsLock, numTickets, sellersDone));
+    printf("%d sellers sold %d tickets\n", NUM_SELLERS, sold);
+  }
+  FreeThreadPackage(); // also writes the trace when run with -v
+  printf("All done!\n");
+  return 0;
+}
@@ -0,0 +1,22 @@
+/**
+ * trace2json.c
+ * ------------
+ * Converts a binary trace written by thread_107 (run any example with -v)
+ * into Chrome trace JSON, which chrome://tracing and ui.perfetto.dev open.
+ *
+ *     gcc trace2json.c thread_107.c -o trace2json -w -g -lpthread
+ *     ./trace2json thread_107.trace trace.json
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "thread_107.h"
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <trace file> <json file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    return TraceConvertToChrome(argv[1], argv[2]) ? EXIT_SUCCESS : EXIT_FAILURE;
+}